@@ -0,0 +1,150 @@
+#pragma once
+#include "fileinput.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+/* ram preview: frames rendered at display resolution, kept in locked memory so
+ * playback of the range between the in and out points runs from ram at a fixed
+ * rate, no matter how slow the files are to read or convert. all frames are
+ * rendered with the same conversion, changing it drops the cache. */
+
+// default memory the cached frames may take, at most half the physical memory
+#define CACHE_BUDGET (2ul<<30)
+
+typedef struct cache_t
+{
+  int num;                    // number of frames in the sequence
+  uint32_t **frame;           // display pixels per frame, null if not cached
+  uint64_t *used;             // when the frame was last used, for eviction
+  uint64_t clock;             // counts uses
+  size_t budget;              // memory the frames may take
+  size_t size;                // memory they take now
+  int begin, end;             // in and out point, inclusive
+  int fill;                   // render ahead in the background
+  int locked;                 // zero once mlock failed, we don't try again
+
+  fileinput_conversion_t key; // conversion all frames were rendered with
+  int lut_serial;             // and the version of the display lut
+  size_t frame_size;          // bytes per frame
+}
+cache_t;
+
+/* cache for num frames in at most budget bytes of locked memory, or CACHE_BUDGET
+ * if it is -1. no more than the physical memory is used either way. */
+static inline void cache_init(cache_t *c, const int num, const ssize_t budget)
+{
+  memset(c, 0, sizeof(*c));
+  c->num = num;
+  c->frame = (uint32_t **)calloc(num, sizeof(uint32_t *));
+  c->used = (uint64_t *)calloc(num, sizeof(uint64_t));
+  c->begin = 0;
+  c->end = num - 1;
+  c->locked = 1;
+  const size_t mem = (size_t)sysconf(_SC_PHYS_PAGES)*sysconf(_SC_PAGESIZE);
+  c->budget = budget < 0 ? MIN(CACHE_BUDGET, mem/2) : MIN((size_t)budget, mem);
+  // locking is limited per process, ask for all we are allowed to
+  struct rlimit rl;
+  if(!getrlimit(RLIMIT_MEMLOCK, &rl) && rl.rlim_cur < rl.rlim_max)
+  {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_MEMLOCK, &rl);
+  }
+}
+
+static inline void cache_drop(cache_t *c, const int k)
+{
+  if(!c->frame[k]) return;
+  munmap(c->frame[k], c->frame_size);
+  c->frame[k] = 0;
+  c->size -= c->frame_size;
+}
+
+static inline void cache_clear(cache_t *c)
+{
+  for(int k=0;k<c->num;k++) cache_drop(c, k);
+}
+
+static inline void cache_cleanup(cache_t *c)
+{
+  if(c->frame) cache_clear(c);
+  free(c->frame);
+  free(c->used);
+  c->frame = 0;
+  c->used = 0;
+  c->num = 0;
+}
+
+/* drop all frames if they were rendered differently than conv would now. */
+static inline void cache_validate(cache_t *c, const fileinput_conversion_t *conv, const int lut_serial)
+{
+  const fileinput_conversion_t *o = &c->key;
+  if(c->lut_serial == lut_serial &&
+     o->exposure == conv->exposure && o->channels == conv->channels &&
+     o->colorin == conv->colorin && o->colorout == conv->colorout &&
+     o->curve == conv->curve && o->gamutmap == conv->gamutmap && o->filter == conv->filter &&
+     o->roi.scale == conv->roi.scale && o->roi.x == conv->roi.x && o->roi.y == conv->roi.y &&
+     o->roi_out.w == conv->roi_out.w && o->roi_out.h == conv->roi_out.h)
+    return;
+  cache_clear(c);
+  c->key = *conv;
+  c->lut_serial = lut_serial;
+  c->frame_size = sizeof(uint32_t)*conv->roi_out.w*conv->roi_out.h;
+}
+
+static inline int cache_in_range(const cache_t *c, const int k)
+{
+  return k >= c->begin && k <= c->end;
+}
+
+/* the cached pixels of frame k, or null. */
+static inline const uint32_t *cache_get(cache_t *c, const int k)
+{
+  if(c->frame[k]) c->used[k] = ++c->clock;
+  return c->frame[k];
+}
+
+/* memory for frame k, to be filled by the caller. the least recently used frames
+ * outside the range make room if needed, frames in the range are never evicted.
+ * returns null if there is no room. */
+static inline uint32_t *cache_alloc(cache_t *c, const int k)
+{
+  if(c->frame[k]) return c->frame[k];
+  while(c->size + c->frame_size > c->budget)
+  {
+    int lru = -1;
+    for(int j=0;j<c->num;j++)
+      if(c->frame[j] && !cache_in_range(c, j) && (lru < 0 || c->used[j] < c->used[lru])) lru = j;
+    if(lru < 0) return 0;
+    cache_drop(c, lru);
+  }
+  uint32_t *f = (uint32_t *)mmap(0, c->frame_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(f == MAP_FAILED) return 0;
+  if(c->locked && mlock(f, c->frame_size))
+  {
+    fprintf(stderr, "[cache] could not lock frames in memory, they may be swapped out (see ulimit -l)\n");
+    c->locked = 0;
+  }
+  c->frame[k] = f;
+  c->used[k] = ++c->clock;
+  c->size += c->frame_size;
+  return f;
+}
+
+/* copy the pixels of frame k into the cache, if there is room. */
+static inline void cache_put(cache_t *c, const int k, const uint32_t *pixels)
+{
+  uint32_t *f = cache_alloc(c, k);
+  if(f && f != pixels) memcpy(f, pixels, c->frame_size);
+}
+
+/* number of cached frames in the range. */
+static inline int cache_count(const cache_t *c)
+{
+  int cnt = 0;
+  for(int k=c->begin;k<=c->end;k++) cnt += c->frame[k] != 0;
+  return cnt;
+}
@@ -0,0 +1,28 @@
+#ifndef CORONA_COLOROUT_H
+#define CORONA_COLOROUT_H
+
+// matrix and gammas below are read by profile.h, older headers only have the function
+#define COLOROUT_CUSTOM_PROFILE
+
+// created for /usr/share/color/argyll/ref/sRGB.icm
+static const float colorout_custom_xyz_to_rgb[] =
+{
+  3.24098245796182477888, -1.53746119787722604863, -.49863933040938950320,
+  -.96928282108131036624, 1.87599094572176246173, .04156124552878093778,
+  .05566083510567107827, -.20399485317594359118, 1.05736353854618246226,
+};
+
+// gamma of the red, green and blue tone curves
+static const float colorout_custom_gamma[] = { 2.2f, 2.2f, 2.2f };
+
+static inline void colorout_xyz_to_rgb(const float *const xyz, float *rgb)
+{
+  rgb[0] = rgb[1] = rgb[2] = 0.0f;
+  for(int k=0;k<3;k++)
+    for(int i=0;i<3;i++) rgb[k] += xyz[i]*colorout_custom_xyz_to_rgb[i+3*k];
+
+  // apply tonecurve
+  for(int k=0;k<3;k++) rgb[k] = powf(rgb[k], 1.f/colorout_custom_gamma[k]);
+}
+
+#endif
@@ -0,0 +1,66 @@
+#pragma once
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/* instruction set tiers of the hot kernels. the binary is built for the baseline
+ * of the architecture, the kernels are compiled once per tier and the best tier
+ * the cpu supports is picked at runtime. set EU_ISA=sse2|avx2|avx512 in the
+ * environment to force a lower tier, for instance to compare them. */
+
+typedef enum cpu_isa_t
+{
+  s_cpu_sse2 = 0,   // architecture baseline (plain c on anything but x86)
+  s_cpu_avx2,       // avx2 + fma
+  s_cpu_avx512,     // avx512f
+  s_cpu_cnt,
+}
+cpu_isa_t;
+
+static const char *cpu_isa_name[] = {"sse2", "avx2", "avx512"};
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_X86 1
+#define CPU_TARGET_AVX2   __attribute__((target("avx2,fma")))
+#define CPU_TARGET_AVX512 __attribute__((target("avx512f,avx2,fma")))
+#else
+#define CPU_X86 0
+#endif
+
+static inline cpu_isa_t _cpu_isa_detect()
+{
+  cpu_isa_t isa = s_cpu_sse2;
+#if CPU_X86
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) isa = s_cpu_avx2;
+  if(isa == s_cpu_avx2 && __builtin_cpu_supports("avx512f")) isa = s_cpu_avx512;
+#endif
+  const char *force = getenv("EU_ISA");
+  if(force)
+  {
+    int k = 0;
+    while(k < s_cpu_cnt && strcmp(force, cpu_isa_name[k])) k++;
+    if(k == s_cpu_cnt)
+      fprintf(stderr, "[cpu] unknown EU_ISA `%s', use sse2, avx2 or avx512\n", force);
+    else if(k > isa)
+      fprintf(stderr, "[cpu] EU_ISA `%s' not supported by this cpu, using %s\n", force, cpu_isa_name[isa]);
+    else isa = k;
+  }
+  return isa;
+}
+
+static cpu_isa_t _cpu_isa = s_cpu_sse2;
+static pthread_once_t _cpu_isa_once = PTHREAD_ONCE_INIT;
+
+static inline void _cpu_isa_init()
+{
+  _cpu_isa = _cpu_isa_detect();
+}
+
+/* best instruction set tier of this cpu, detected once. safe to call from any thread. */
+static inline cpu_isa_t cpu_isa()
+{
+  pthread_once(&_cpu_isa_once, _cpu_isa_init);
+  return _cpu_isa;
+}
@@ -7,9 +7,18 @@
 #include <math.h>
 #include <string.h>
 #include <stdarg.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
 #include <xmmintrin.h>
 
-static const int eventMask = KeyPressMask | KeyReleaseMask | ButtonPressMask | ButtonReleaseMask | PointerMotionMask | PointerMotionHintMask | ButtonMotionMask;
+// no motion hints, motion events are folded in the queue instead of asking the server
+#define MIN(A, B) (((A) > (B)) ? (B) : (A))
+#define MAX(A, B) (((A) < (B)) ? (B) : (A))
+#define CLAMP(A, L, H) (((A) > (L)) ? (((A) < (H)) ? (A) : (H)) : (L))
+
+static const int eventMask = KeyPressMask | KeyReleaseMask | ButtonPressMask | ButtonReleaseMask | PointerMotionMask | ButtonMotionMask | StructureNotifyMask;
 #define keyMapSize 256
 
 static keycode_t normalKeys[keyMapSize];
@@ -47,6 +56,169 @@ static const unsigned char font9x16[] = {
 4,16,0,0,7,226,7,242,0,18,0,18,0,22,7,252,7,248,0,0,0,0,6,48,6,112,4,208,5,144,7,16,6,48,4,48,0,0,0,0,0,0,2,0,2,0,31,224,61,240,32,16,32,16,0,0,0,0,0,0,0,0,0,0,
 62,248,62,248,0,0,0,0,0,0,0,0,0,0,32,16,32,16,61,240,31,224,2,0,2,0,0,0,0,0,32,0,96,0,64,0,96,0,32,0,96,0,64,0,0,0,0,0,1,224,3,224,6,32,12,32,6,32,3,224,1,224,0,0};
 
+static inline double _display_time()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec*1e-9;
+}
+
+static int _display_shm_failed = 0;
+static int _display_shm_error(Display *dpy, XErrorEvent *ev)
+{
+  _display_shm_failed = 1;
+  return 0;
+}
+
+// create image k in a shared memory segment, zero on success
+static int _display_shm_init(display_t *d, const int k)
+{
+  // the server needs to see our memory, only try for local displays
+  const char *name = DisplayString(d->display);
+  if(name[0] != ':' && strncmp(name, "unix:", 5)) return 1;
+  if(!XShmQueryExtension(d->display)) return 1;
+
+  XShmSegmentInfo *shm = d->shm + k;
+  d->image[k] = XShmCreateImage(d->display, d->visual, d->depth, ZPixmap, 0, shm, d->width, d->height);
+  if(!d->image[k]) return 1;
+  shm->shmid = shmget(IPC_PRIVATE, d->image[k]->bytes_per_line * d->image[k]->height, IPC_CREAT | 0600);
+  if(shm->shmid < 0) goto fail;
+  shm->shmaddr = d->image[k]->data = shmat(shm->shmid, 0, 0);
+  if(shm->shmaddr == (char *)-1) goto fail;
+  shm->readOnly = False;
+
+  // attaching fails asynchronously, sync to catch the error
+  _display_shm_failed = 0;
+  int (*handler)(Display *, XErrorEvent *) = XSetErrorHandler(_display_shm_error);
+  XShmAttach(d->display, shm);
+  XSync(d->display, False);
+  XSetErrorHandler(handler);
+  // the segment goes away with the last detach, also if we crash
+  shmctl(shm->shmid, IPC_RMID, 0);
+  if(_display_shm_failed) goto fail;
+
+  d->buffer[k] = (uint32_t *)shm->shmaddr;
+  d->shm_completion = XShmGetEventBase(d->display) + ShmCompletion;
+  return 0;
+fail:
+  if(shm->shmaddr && shm->shmaddr != (char *)-1) shmdt(shm->shmaddr);
+  else if(shm->shmid >= 0) shmctl(shm->shmid, IPC_RMID, 0);
+  d->image[k]->data = 0;
+  XDestroyImage(d->image[k]);
+  d->image[k] = 0;
+  memset(shm, 0, sizeof(*shm));
+  return 1;
+}
+
+static void _display_shm_cleanup(display_t *d, const int k)
+{
+  XShmDetach(d->display, d->shm + k);
+  d->image[k]->data = 0;
+  XDestroyImage(d->image[k]);
+  shmdt(d->shm[k].shmaddr);
+  d->image[k] = 0;
+  d->buffer[k] = 0;
+}
+
+// create the (image) buffers for the current size, in shared memory if we can
+static int _display_alloc(display_t *d)
+{
+  d->use_shm = !d->headless && !_display_shm_init(d, 0);
+  for(int k=1;k<DISPLAY_BUFFERS && d->use_shm;k++)
+    if(_display_shm_init(d, k))
+    {
+      for(int j=0;j<k;j++) _display_shm_cleanup(d, j);
+      d->use_shm = 0;
+    }
+  if(!d->use_shm) for(int k=0;k<DISPLAY_BUFFERS;k++)
+  {
+    d->buffer[k] = aligned_alloc(128, sizeof(uint32_t) * d->width * d->height);
+    if (!d->buffer[k])
+      return 1;
+    if (d->headless) continue;
+
+    d->image[k] = XCreateImage(d->display, CopyFromParent, d->depth, ZPixmap, 0, 0,
+        d->width, d->height, 32, d->width * sizeof(uint32_t));
+    if (!d->image[k])
+      return 1;
+#if 1//defined(__LITTLE_ENDIAN__)
+    d->image[k]->byte_order = LSBFirst;
+#else
+    d->image[k]->byte_order = MSBFirst;
+#endif	
+  }
+  d->capacity = (size_t)d->width * d->height;
+  d->overlay = (uint8_t *)calloc(d->capacity, sizeof(uint8_t));
+  d->under = (uint32_t *)malloc(sizeof(uint32_t) * d->capacity);
+  if (!d->overlay || !d->under)
+    return 1;
+  d->ov_x0 = d->ov_y0 = d->ov_x1 = d->ov_y1 = 0;
+  d->un_x0 = d->un_y0 = d->un_x1 = d->un_y1 = 0;
+  d->overlay_dirty = 1;
+  d->shown = -1;
+  return 0;
+}
+
+static void _display_free(display_t *d)
+{
+  if (d->use_shm)
+  {
+    display_wait(d);
+    for(int k=0;k<DISPLAY_BUFFERS;k++) if (d->image[k]) _display_shm_cleanup(d, k);
+  }
+  for(int k=0;k<DISPLAY_BUFFERS;k++)
+  {
+    if (d->image[k])
+    {
+      d->image[k]->data = 0;
+      XDestroyImage(d->image[k]);
+    }
+    free(d->buffer[k]);
+    d->image[k] = 0;
+    d->buffer[k] = 0;
+  }
+  free(d->overlay);
+  free(d->under);
+  d->overlay = 0;
+  d->under = 0;
+  d->capacity = 0;
+}
+
+static Bool _display_is_completion(Display *dpy, XEvent *ev, XPointer arg)
+{
+  return ev->type == ((display_t *)arg)->shm_completion;
+}
+
+// block until the server is done reading the last upload
+void display_wait(display_t *d)
+{
+  XEvent event;
+  if(d->headless) return;
+  if(d->shm_busy) XIfEvent(d->display, &event, _display_is_completion, (XPointer)d);
+  d->shm_busy = 0;
+}
+
+// the font expanded to one byte per pixel, as in the overlay: ascii 32..127, then the blocks u2581..u2588
+#define DISPLAY_GLYPHS (96 + 8)
+static uint8_t _display_atlas[DISPLAY_GLYPHS][16][9];
+static int _display_atlas_initialized = 0;
+
+static void _display_atlas_init()
+{
+  for (int c = 0; c < 96; c++)
+    for (int x = 0; x < 9*2; x++)
+    {
+      const unsigned char cLine = font9x16[c*9*2 + x];
+      for (int i = 0; i < 8; i++)
+        _display_atlas[c][i + (x&1)*8][x/2] = (cLine & (1<<(7-i))) ? 2 : 1;
+    }
+  // u2581..u2588 fill an eighth to all of the cell from the bottom
+  for (int c = 0; c < 8; c++)
+    for (int j = 0; j < 16; j++)
+      memset(_display_atlas[96 + c][15 - j], j < 2*(c+1) ? 2 : 1, 9);
+  _display_atlas_initialized = 1;
+}
+
 int initializeKeyMaps()
 {
   for (int i = 0; i < keyMapSize; ++i)
@@ -201,17 +373,67 @@ int initializeKeyMaps()
   return 1;
 }
 
+// where the channels go in a pixel, the converters write this layout directly
+static void _display_format(display_t *d, const unsigned long red, const unsigned long green, const unsigned long blue)
+{
+  const unsigned long mask[3] = {red, green, blue};
+  for(int k=0;k<3;k++) d->shift[k] = mask[k] ? __builtin_ctzl(mask[k]) : 0;
+  d->bits = green ? __builtin_popcountl(green) : 8;
+  // text colour, and the mask to darken the background by shifting one bit down
+  d->text_fg = d->text_dim = 0;
+  for(int k=0;k<3;k++)
+  {
+    const uint32_t m = ((1u << d->bits) - 1) << d->shift[k];
+    d->text_fg |= ((0xc8u << d->bits) / 0x100) << d->shift[k];
+    d->text_dim |= (m >> 1) & m;
+  }
+}
+
+/* a display without a window: frames go to memory and the events come from the
+ * script (- for stdin), see _display_script. uploads are not paced, so the
+ * frames come as fast as they are rendered. */
+display_t *display_open_headless(const char *script, int width, int height)
+{
+  if(!keyMapsInitialized) keyMapsInitialized = initializeKeyMaps();
+  if(!_display_atlas_initialized) _display_atlas_init();
+  display_t *d = (display_t*) calloc(1, sizeof(display_t));
+  d->headless = 1;
+  d->script = strcmp(script, "-") ? fopen(script, "r") : stdin;
+  if (!d->script)
+  {
+    free(d);
+    return 0;
+  }
+  d->width = width;
+  d->height = height;
+  d->bit_depth = 24;
+  d->shown = -1;
+  _display_format(d, 0xff0000, 0xff00, 0xff);
+  d->msg[0] = '\0';
+  if (_display_alloc(d))
+  {
+    display_close(d);
+    return 0;
+  }
+  return d;
+}
+
 display_t *display_open(const char title[], int width, int height)
 {
   if(!keyMapsInitialized) keyMapsInitialized = initializeKeyMaps();
-  display_t *d = (display_t*) malloc(sizeof(display_t));
+  if(!_display_atlas_initialized) _display_atlas_init();
+  display_t *d = (display_t*) calloc(1, sizeof(display_t));
   d->mod_state = 0;
 
   // let's open a display
 
   d->display = XOpenDisplay(0);
   if (!d->display)
+  {
+    fprintf(stderr, "[display] could not open the x display\n");
+    free(d);
     return 0;
+  }
 
   d->width = width;
   d->height = height;
@@ -248,8 +470,11 @@ display_t *display_open(const char title[], int width, int height)
   const int bufferDepth = displayDepth == 24 ? 32 : displayDepth;
   const int bytesPerPixel = (bufferDepth + 7) / 8;
   const int bitsPerPixel = 8 * bytesPerPixel;
-  if (bitsPerPixel != 16 && bitsPerPixel != 32)
+  // the converters write 32-bit pixels
+  if (bitsPerPixel != 32)
   {
+    fprintf(stderr, "[display] the default visual has a depth of %d bits, only 24 and 30 bit visuals (32 bits per pixel) are supported\n",
+        displayDepth);
     display_close(d);
     return 0;
   }
@@ -299,37 +524,27 @@ display_t *display_open(const char title[], int width, int height)
   }
 
   XSizeHints sizeHints;
-  sizeHints.flags = PPosition | PMinSize | PMaxSize;
+  sizeHints.flags = PPosition | PMinSize;
   sizeHints.x = sizeHints.y = 0;
-  sizeHints.min_width = sizeHints.max_width = width;
-  sizeHints.min_height = sizeHints.max_height = height;
+  sizeHints.min_width = 64;
+  sizeHints.min_height = 64;
   XSetNormalHints(d->display, d->window, &sizeHints);
   XClearWindow(d->display, d->window);
   XSelectInput(d->display, d->window, eventMask);
 
-  // create (image) buffer
-
-  d->buffer = aligned_alloc(128, sizeof(char) * width * height * bytesPerPixel);
-  if (!d->buffer)
-  {
-    display_close(d);
-    return 0;
-  }
+  // create (image) buffers
 
   d->gc = DefaultGC(d->display, screen);
-  d->image = XCreateImage(d->display, CopyFromParent, displayDepth, ZPixmap, 0, 0,
-      width, height, bitsPerPixel, width * bytesPerPixel);
-#if 1//defined(__LITTLE_ENDIAN__)
-  d->image->byte_order = LSBFirst;
-#else
-  d->image->byte_order = MSBFirst;
-#endif	
-  if (!d->image)
+  d->visual = visual;
+  d->depth = displayDepth;
+  if (_display_alloc(d))
   {
     display_close(d);
     return 0;
   }
 
+  _display_format(d, visual->red_mask, visual->green_mask, visual->blue_mask);
+
   d->msg[0] = '\0';
   d->msg_len = 0;
 
@@ -344,8 +559,15 @@ display_t *display_open(const char title[], int width, int height)
 void display_close(display_t *d)
 {	
   if(!d) return;
-  if (d->image)
-    XDestroyImage(d->image);
+  _display_free(d);
+  if (d->headless)
+  {
+    if (d->script && d->script != stdin) fclose(d->script);
+    fprintf(stderr, "[display] %lu frames, %.2f ms per frame back to back, %lu events (%lu folded)\n",
+        (unsigned long)d->num_frames,
+        d->busy_frames ? 1e3*d->busy_time/d->busy_frames : 0.0,
+        (unsigned long)d->num_events, (unsigned long)d->num_dropped);
+  }
 
   if (d->display && d->window)
     XDestroyWindow(d->display, d->window);
@@ -353,49 +575,79 @@ void display_close(display_t *d)
   if (d->display)
     XCloseDisplay(d->display);
 
-  if (d->buffer) free(d->buffer);
   free(d);
 }
 
+// hand the pointer position folded from the last motion events to the app
+static inline int _display_flush_motion(display_t *d)
+{
+  if(!d->moved) return 0;
+  d->moved = 0;
+  return d->onMouseMove ? d->onMouseMove(&d->mouse) : 0;
+}
+
+// hand the last size of the window to the app, at most every DISPLAY_RESIZE_INTERVAL
+static inline int _display_flush_resize(display_t *d)
+{
+  const double now = _display_time();
+  if(!d->resized || now < d->last_resize + DISPLAY_RESIZE_INTERVAL) return 0;
+  d->resized = 0;
+  if(d->resize_w == d->width && d->resize_h == d->height) return 0;
+  d->last_resize = now;
+  if(d->onResize) return d->onResize(d->resize_w, d->resize_h);
+  display_resize(d, d->resize_w, d->resize_h);
+  return 1;
+}
+
+// hand a key press or release to the app
+static inline int _display_key(display_t *d, const KeySym keySym, const int press)
+{
+  int ret = 0;
+  const int hiSym = (keySym & 0xff00) >> 8;
+  const int loSym = keySym & 0xff;
+
+  keycode_t code = KeyUndefined;
+  switch (hiSym)
+  {
+    case 0x00:
+      code = normalKeys[loSym];
+      break;
+    case 0xff:
+      code = functionKeys[loSym];
+      break;
+  }
+
+  if (press)
+  {
+    // if (!keyIsPressed[code])
+    {
+      if (code == KeyEscape) d->isShuttingDown = 1;
+      else if(d->onKeyDown) ret = d->onKeyDown(code);
+    }
+    keyIsPressed[code] = 1;
+    keyIsReleased[code] = 0;
+  }
+  else
+  {
+    keyIsReleased[code] = 1;
+  }
+  return ret;
+}
+
 static inline int handleEvent(const XEvent *event, display_t *d)
 {
-  static Time prevtime = 0;
   int ret = 0;
+  d->num_events++;
+  // everything but motion sees the pointer where it was when it happened
+  const int moved = event->type != MotionNotify ? _display_flush_motion(d) : 0;
+  if(moved < 0) return moved;
   switch (event->type)
   {
     case KeyPress:
     case KeyRelease:
       {
         d->mod_state = event->xkey.state;
-        const KeySym keySym = XkbKeycodeToKeysym (d->display, event->xkey.keycode, 0, 0);
-        const int hiSym = (keySym & 0xff00) >> 8;
-        const int loSym = keySym & 0xff;
-
-        keycode_t code = KeyUndefined;
-        switch (hiSym)
-        {
-          case 0x00:
-            code = normalKeys[loSym];
-            break;
-          case 0xff:
-            code = functionKeys[loSym];
-            break;
-        }
-
-        if (event->type == KeyPress)
-        {
-          // if (!keyIsPressed[code])
-          {
-            if (code == KeyEscape) d->isShuttingDown = 1;
-            else if(d->onKeyDown) ret = d->onKeyDown(code);
-          }
-          keyIsPressed[code] = 1;
-          keyIsReleased[code] = 0;
-        }
-        else
-        {
-          keyIsReleased[code] = 1;
-        }
+        ret = _display_key(d, XkbKeycodeToKeysym (d->display, event->xkey.keycode, 0, 0), event->type == KeyPress);
         break;
       }
 
@@ -419,26 +671,22 @@ static inline int handleEvent(const XEvent *event, display_t *d)
         break;
       }
     case MotionNotify:
-      {
-        if(d->onMouseMove)
-        {
-          int numev = 0;
-          XTimeCoord *t = XGetMotionEvents(d->display, d->window, prevtime,
-              0, &numev);
-          prevtime = event->xmotion.time;
-          for(int i=0;i<numev;i++)
-          {
-            mouse_t mouse;
-            mouse.x = t[i].x;//event->xmotion.x;
-            mouse.y = t[i].y;//event->xmotion.y;
-            mouse.buttons.left = (event->xmotion.state & Button1Mask) != 0;
-            mouse.buttons.middle = (event->xmotion.state & Button2Mask) != 0;
-            mouse.buttons.right = (event->xmotion.state & Button3Mask) != 0;
-            int ret2 = d->onMouseMove(&mouse);
-            if(ret2 < 0) return ret2;
-            ret = ret2 ? ret2 : ret;
-          }
-        }
+      { // only the latest position counts
+        if(d->moved) d->num_dropped++;
+        d->moved = 1;
+        d->mouse.x = event->xmotion.x;
+        d->mouse.y = event->xmotion.y;
+        d->mouse.buttons.left = (event->xmotion.state & Button1Mask) != 0;
+        d->mouse.buttons.middle = (event->xmotion.state & Button2Mask) != 0;
+        d->mouse.buttons.right = (event->xmotion.state & Button3Mask) != 0;
+        break;
+      }
+    case ConfigureNotify:
+      { // only the last size counts, it is applied when the events are pumped
+        if(d->resized) d->num_dropped++;
+        d->resized = 1;
+        d->resize_w = event->xconfigure.width;
+        d->resize_h = event->xconfigure.height;
         break;
       }
     case ClientMessage:
@@ -453,6 +701,126 @@ static inline int handleEvent(const XEvent *event, display_t *d)
         break;
       }
   }
+  return ret < 0 ? ret : ret + moved;
+}
+
+// write the frame on screen as 8-bit binary ppm
+static int _display_dump(const display_t *d, const char *filename)
+{
+  if (d->shown < 0) return 1;
+  FILE *f = fopen(filename, "wb");
+  if (!f) return 1;
+  fprintf(f, "P6\n%d %d\n255\n", d->width, d->height);
+  const uint32_t *px = d->buffer[d->shown];
+  const uint32_t m = (1u << d->bits) - 1;
+  uint8_t *row = (uint8_t *)malloc(3*d->width);
+  for(int j=0;j<d->height && row;j++)
+  {
+    for(int i=0;i<d->width;i++) for(int c=0;c<3;c++)
+      row[3*i+c] = ((px[d->width*j+i] >> d->shift[c]) & m) >> (d->bits - 8);
+    fwrite(row, 3, d->width, f);
+  }
+  free(row);
+  fclose(f);
+  return !row;
+}
+
+/* headless: run the script until it waits for time or frames to pass. every line
+ * is one command, # starts a comment:
+ *   key [shift+]<keysym>   press and release a key, by x keysym name
+ *   move x y               move the pointer
+ *   down x y [button]      press a mouse button, 1 by default
+ *   up x y [button]        and release it
+ *   wait s                 let s seconds pass
+ *   frames n               let n more frames be shown, or none for DISPLAY_SCRIPT_IDLE
+ *   dump file.ppm          write the frame on screen
+ *   resize w h             resize the window
+ *   quit                   (or the end of the script) shut down */
+static int _display_script(display_t *d)
+{
+  int ret = 0;
+  char line[1024], arg[1024];
+  while (!d->isShuttingDown)
+  {
+    const double now = _display_time();
+    if (now < d->script_until) break;
+    if (d->num_frames < d->script_frames)
+    { // until the renderer has nothing more to show
+      if (now < fmax(d->script_until, d->last_frame) + DISPLAY_SCRIPT_IDLE) break;
+      d->script_frames = 0;
+    }
+    if (!fgets(line, sizeof(line), d->script))
+    {
+      d->isShuttingDown = 1;
+      break;
+    }
+    d->script_line++;
+    int ret2 = 0, x = 0, y = 0, n = 1;
+    double s;
+    XEvent event;
+    memset(&event, 0, sizeof(event));
+    if (sscanf(line, " %1023s", arg) != 1 || arg[0] == '#') continue;
+    if (!strcmp(arg, "key") && sscanf(line, " key %1023s", arg) == 1)
+    {
+      const int shift = !strncmp(arg, "shift+", 6);
+      const KeySym sym = XStringToKeysym(arg + 6*shift);
+      if (sym == NoSymbol)
+      {
+        fprintf(stderr, "[display] script line %d: unknown key `%s'\n", d->script_line, arg);
+        continue;
+      }
+      d->num_events++;
+      d->mod_state = shift ? s_display_shift : 0;
+      ret2 = _display_flush_motion(d);
+      if (ret2 >= 0) ret2 += _display_key(d, sym, 1);
+      if (ret2 >= 0) ret2 += _display_key(d, sym, 0);
+    }
+    else if (!strcmp(arg, "move") && sscanf(line, " move %d %d", &x, &y) == 2)
+    {
+      event.type = MotionNotify;
+      event.xmotion.x = x;
+      event.xmotion.y = y;
+      event.xmotion.state = d->script_buttons;
+      ret2 = handleEvent(&event, d);
+    }
+    else if ((!strcmp(arg, "down") || !strcmp(arg, "up")) &&
+        sscanf(line, " %*s %d %d %d", &x, &y, &n) >= 2 && n >= 1 && n <= 5)
+    {
+      event.type = arg[0] == 'd' ? ButtonPress : ButtonRelease;
+      event.xbutton.x = x;
+      event.xbutton.y = y;
+      event.xbutton.button = n;
+      ret2 = handleEvent(&event, d);
+      const unsigned int mask = Button1Mask << (n - 1);
+      d->script_buttons = arg[0] == 'd' ? d->script_buttons | mask : d->script_buttons & ~mask;
+    }
+    else if (!strcmp(arg, "wait") && sscanf(line, " wait %lf", &s) == 1)
+      d->script_until = now + s;
+    else if (!strcmp(arg, "frames") && sscanf(line, " frames %d", &n) == 1)
+    {
+      d->script_until = now;
+      d->script_frames = d->num_frames + n;
+    }
+    else if (!strcmp(arg, "dump") && sscanf(line, " dump %1023s", arg) == 1)
+    {
+      if (_display_dump(d, arg))
+        fprintf(stderr, "[display] script line %d: could not write `%s'\n", d->script_line, arg);
+    }
+    else if (!strcmp(arg, "resize") && sscanf(line, " resize %d %d", &x, &y) == 2 && x > 0 && y > 0)
+    {
+      event.type = ConfigureNotify;
+      event.xconfigure.width = x;
+      event.xconfigure.height = y;
+      ret2 = handleEvent(&event, d);
+      d->last_resize = 0.0; // no window manager to keep up with
+    }
+    else if (!strcmp(arg, "quit"))
+      d->isShuttingDown = 1;
+    else
+      fprintf(stderr, "[display] script line %d: can't parse `%s'\n", d->script_line, arg);
+    if (ret2 < 0) return ret2;
+    ret += ret2;
+  }
   return ret;
 }
 
@@ -460,7 +828,9 @@ int display_pump_events(display_t *d)
 {
   XEvent event;
   int ret = 0;
-  while (1)
+  if (d->headless) ret = _display_script(d);
+  if (ret < 0) return ret;
+  while (!d->headless)
   {
     if (d->isShuttingDown) return -1;
     int ret2 = 0;
@@ -468,11 +838,19 @@ int display_pump_events(display_t *d)
       ret2 = handleEvent(&event, d);
     else if (XCheckTypedEvent(d->display, ClientMessage, &event))
       ret2 = handleEvent(&event, d);
+    else if (d->use_shm && XCheckTypedEvent(d->display, d->shm_completion, &event))
+      d->shm_busy = 0;
     else break;
     if(ret2 < 0) return ret2;
     ret += ret2;
   }
-  return d->isShuttingDown ? -1 : ret;
+  // the queue is drained, now act on the last motion and size
+  int ret2 = _display_flush_motion(d);
+  if(ret2 < 0) return ret2;
+  ret += ret2;
+  ret2 = _display_flush_resize(d);
+  if(ret2 < 0) return ret2;
+  return d->isShuttingDown ? -1 : ret + ret2;
 }
 
 int display_wait_event(display_t *d)
@@ -481,21 +859,85 @@ int display_wait_event(display_t *d)
   XEvent event;
   XNextEvent(d->display, &event);
   int ret = handleEvent(&event, d);
+  if(ret >= 0) ret += _display_flush_motion(d);
   if(d->isShuttingDown) return -1;
   return ret;
 }
 
-static inline void display_render_text(
-    display_t *d,
-    uint32_t *pixels)
+// seconds until the next frame may be uploaded, at most one per refresh of the screen
+double display_pace(const display_t *d)
 {
-  // render message:
+  if (d->headless) return 0.0; // as fast as we can
+  return d->last_frame + 1.0/DISPLAY_REFRESH - _display_time();
+}
+
+// wait up to timeout seconds (forever if negative) for events or for fd to become
+// readable, non-zero if there are events
+int display_poll(display_t *d, const int fd, double timeout)
+{
+  if (d->headless)
+  { // the script goes on after a while, or with the next frame
+    const double now = _display_time();
+    const double idle = fmax(d->script_until, d->last_frame) + DISPLAY_SCRIPT_IDLE;
+    if (now >= d->script_until && (d->num_frames >= d->script_frames || now >= idle))
+      return 1;
+    const double due = d->num_frames < d->script_frames ? idle : d->script_until;
+    timeout = timeout < 0.0 ? due - now : fmin(timeout, due - now);
+    struct pollfd p = { .fd = fd, .events = POLLIN };
+    poll(&p, fd < 0 ? 0 : 1, (int)(1000*fmax(0.0, timeout)));
+    return 0;
+  }
+  if(XPending(d->display)) return 1;
+  if(d->resized)
+  { // wake up to apply the new size
+    const double due = fmax(0.0, d->last_resize + DISPLAY_RESIZE_INTERVAL - _display_time());
+    timeout = timeout < 0.0 ? due : fmin(timeout, due);
+  }
+  struct pollfd p[2] = {
+    { .fd = ConnectionNumber(d->display), .events = POLLIN },
+    { .fd = fd, .events = POLLIN },
+  };
+  poll(p, fd < 0 ? 1 : 2, timeout < 0.0 ? -1 : (int)(1000*timeout));
+  return XPending(d->display);
+}
+
+// clear the overlay in its rectangle
+static inline void _display_overlay_clear(display_t *d)
+{
+  for (int y = d->ov_y0; y < d->ov_y1; y++)
+    memset(d->overlay + d->width*y + d->ov_x0, 0, d->ov_x1 - d->ov_x0);
+  d->ov_x0 = d->ov_y0 = d->ov_x1 = d->ov_y1 = 0;
+}
+
+// copy a row of a glyph into the overlay at px, y
+static inline void _display_overlay_glyph(display_t *d, const int g, const int px, const int line)
+{
+  const int top = d->msg_y - 15 + line*16;
+  const int n = MIN(9, d->width - px);
+  if (n <= 0) return;
+  for (int j = 0; j < 16; j++)
+  {
+    const int y = top + j;
+    if (y < 0 || y >= d->height) continue;
+    memcpy(d->overlay + d->width*y + px, _display_atlas[g][j], n);
+  }
+  d->ov_x0 = MIN(d->ov_x0, px);
+  d->ov_x1 = MAX(d->ov_x1, px + n);
+  d->ov_y0 = MAX(0, MIN(d->ov_y0, top));
+  d->ov_y1 = MIN(d->height, MAX(d->ov_y1, top + 16));
+}
+
+// lay out the message in the overlay
+static inline void _display_overlay_build(display_t *d)
+{
+  _display_overlay_clear(d);
+  d->ov_x0 = d->ov_y0 = INT32_MAX;
+  d->ov_x1 = d->ov_y1 = 0;
   int px = d->msg_x;
   int line = 0;
   int char_in_line = 0;
   for (int pos = 0; pos < d->msg_len; pos++,char_in_line++)
   {
-    int charPos = (d->msg[pos] - 32)*9*2;
     if (char_in_line > 120)
     {
       while(d->msg[pos] != '\n' && pos < d->msg_len) pos++;
@@ -508,52 +950,72 @@ static inline void display_render_text(
       px = d->msg_x;
     }
     else if((d->msg[pos] & 0xf0) == 0xe0)
-    {
-      const int fill = 2*(d->msg[pos+2] & 0xf);
-      for (int i = 0; i < 9; i++)
-      {
-        if (px < d->width)
-        {
-          for (int j = 0; j < 16; j++)
-          {
-            int y = (d->msg_y - j) + line*16;
-            if ((y >= d->height) || (y < 0)) return;
-            // respect fill ratio for u2581..u2588
-            if(j < fill) pixels[px + y*d->width] = 0xc8c8c8;
-            else         pixels[px + y*d->width] = (pixels[px + y*d->width]>>1)&0x7f7f7f;
-          }
-        }
-        px++;
-      }
+    { // respect fill ratio for u2581..u2588
+      const int fill = CLAMP(d->msg[pos+2] & 0xf, 1, 8);
+      _display_overlay_glyph(d, 96 + fill - 1, px, line);
+      px += 9;
       pos+=2; // munch second and third utf-8 unicode byte
     }
     else
     {
       if(d->msg[pos] == ' ' && // skip adjacent spaces
          ((pos && d->msg[pos-1] == ' ') || (pos+1 < d->msg_len && d->msg[pos+1] == ' ')))
-          px += 9;
-      else for (int x = 0; x < 9*2; x++)
-      {
-        if (px < d->width)
-        {
-          unsigned char cLine = font9x16[charPos+x];			
-          for (int i = 0; i < 8; i++)
-          {
-            int y = (d->msg_y - (15 - (i + (x&1)*8))) + line*16;
-            if ((y >= d->height) || (y < 0)) return;
-            if (cLine & (1<<(7-i)))
-              pixels[px + y*d->width] = 0xc8c8c8;
-            else
-              pixels[px + y*d->width] = (pixels[px + y*d->width]>>1)&0x7f7f7f;
-          }
-        }
-        if (x&1) px++;
-      }
+        ;
+      else if ((unsigned char)d->msg[pos] >= 32 && (unsigned char)d->msg[pos] < 128)
+        _display_overlay_glyph(d, d->msg[pos] - 32, px, line);
+      px += 9;
     }
   }
+  if (d->ov_x1 <= d->ov_x0 || d->ov_y1 <= d->ov_y0)
+    d->ov_x0 = d->ov_y0 = d->ov_x1 = d->ov_y1 = 0;
+  d->overlay_dirty = 0;
+}
+
+// keep the image under the overlay, then draw the overlay on top
+static inline void _display_overlay_composite(display_t *d, uint32_t *pixels)
+{
+  const int x0 = d->ov_x0, x1 = d->ov_x1, w = x1 - x0;
+  const uint32_t fg = d->text_fg, dim = d->text_dim;
+  for (int y = d->ov_y0; y < d->ov_y1; y++)
+  {
+    uint32_t *p = pixels + d->width*y + x0;
+    const uint8_t *a = d->overlay + d->width*y + x0;
+    memcpy(d->under + w*(y - d->ov_y0), p, sizeof(uint32_t)*w);
+    for (int x = 0; x < w; x++)
+      p[x] = a[x] == 2 ? fg : a[x] ? (p[x] >> 1) & dim : p[x];
+  }
+  d->un_x0 = x0; d->un_x1 = x1;
+  d->un_y0 = d->ov_y0; d->un_y1 = d->ov_y1;
+}
+
+// put the image back where the overlay was composited
+static inline void _display_overlay_restore(display_t *d, uint32_t *pixels)
+{
+  const int w = d->un_x1 - d->un_x0;
+  for (int y = d->un_y0; y < d->un_y1; y++)
+    memcpy(pixels + d->width*y + d->un_x0, d->under + w*(y - d->un_y0), sizeof(uint32_t)*w);
 }
 
-int display_update(display_t *d, uint8_t *pixels)
+// send a rectangle of buffer k to the server
+static inline void _display_put(display_t *d, const int k, const int x, const int y, const int w, const int h)
+{
+  if (w <= 0 || h <= 0 || d->headless) return;
+  if (d->use_shm)
+  {
+    // no copy through the socket, the server sends an event when done
+    XShmPutImage(d->display, d->window, d->gc, d->image[k], x, y, x, y, w, h, True);
+    d->shm_busy = 1;
+  }
+  else
+  {
+    d->image[k]->data = (char*)d->buffer[k];
+    XPutImage(d->display, d->window, d->gc, d->image[k], x, y, x, y, w, h);
+    d->image[k]->data = NULL;
+  }
+  XFlush(d->display);
+}
+
+int display_update(display_t *d, uint32_t *pixels)
 {
   if (d->isShuttingDown)
   {
@@ -561,73 +1023,126 @@ int display_update(display_t *d, uint8_t *pixels)
     return 0;
   }
 
-  if (!d->display || !d->window || !d->image)
+  int k = 0;
+  while(k < DISPLAY_BUFFERS && d->buffer[k] != pixels) k++;
+  if ((!d->headless && (!d->display || !d->window)) || k == DISPLAY_BUFFERS)
     return 0;
 
-  const int w = d->width;
-  const int h = d->height;
-  int index = 0;
-  const int size = w*h;
-  if(d->bit_depth == 30)
-  {
-    for (int i = 0; i < size; i++)
-    {
-      // test 10-bit vs 8-bit gradient:
-      // const int r = (int)(0x3ff*CLAMP((i%w)/(w-1.0), 0, 1)) << 20;
-      // const int g = (int)(0x3ff*CLAMP((i%w)/(w-1.0), 0, 1)) << 10;
-      // const int b = (int)(0x3ff*CLAMP((i%w)/(w-1.0), 0, 1)) << 0;
-      const int r = pixels[index+2] << 22;
-      const int g = pixels[index+1] << 12;
-      const int b = pixels[index+0] << 2;
-      index += 3;
-      // rgba
-      d->buffer[i] = r | g | b;
-    }
-  }
-  else // assume 24
-  {
-    for (int i = 0; i < size; i++)
-    {
-      const int r = pixels[index+0] << 16;
-      const int g = pixels[index+1] << 8;
-      const int b = pixels[index+2];
-      index += 3;
-      // rgba
-      d->buffer[i] = r | g | b;
-    }
+  // frame pacing statistics
+  const double now = _display_time();
+  if(d->num_frames && now - d->last_frame < DISPLAY_SCRIPT_IDLE)
+  { // back to back frames, not the pauses in between
+    d->busy_time += now - d->last_frame;
+    d->busy_frames++;
   }
+  if(d->num_frames++)
+    d->frame_time = d->num_frames == 2 ? now - d->last_frame : .9*d->frame_time + .1*(now - d->last_frame);
+  d->last_frame = now;
 
   // render message:
-  display_render_text(d, d->buffer);
-
-  d->image->data = (char*)(d->buffer);
+  if (d->overlay_dirty) _display_overlay_build(d);
+  _display_overlay_composite(d, pixels);
+  d->shown = k;
 
-  XPutImage(d->display, d->window, d->gc, d->image, 0, 0, 0, 0, w, h);
-  XFlush(d->display);
+  _display_put(d, k, 0, 0, d->width, d->height);
+  return 1;
+}
 
-  d->image->data = NULL;
+/* show a new message on the frame on screen, without a new frame. only the
+ * rectangle of the old and new message is composited and uploaded again.
+ * returns non-zero if anything changed. */
+int display_update_overlay(display_t *d)
+{
+  if (!d->overlay_dirty || d->shown < 0 || d->isShuttingDown)
+    return 0;
+  display_wait(d);
+  uint32_t *pixels = d->buffer[d->shown];
+  const int x0 = d->un_x0, y0 = d->un_y0, x1 = d->un_x1, y1 = d->un_y1;
+  _display_overlay_restore(d, pixels);
+  _display_overlay_build(d);
+  _display_overlay_composite(d, pixels);
+  // upload the union of the old and the new rectangle
+  const int was = x1 > x0 && y1 > y0, is = d->un_x1 > d->un_x0 && d->un_y1 > d->un_y0;
+  if (!was && !is) return 1;
+  const int dx0 = !is ? x0 : !was ? d->un_x0 : MIN(x0, d->un_x0);
+  const int dy0 = !is ? y0 : !was ? d->un_y0 : MIN(y0, d->un_y0);
+  const int dx1 = !is ? x1 : !was ? d->un_x1 : MAX(x1, d->un_x1);
+  const int dy1 = !is ? y1 : !was ? d->un_y1 : MAX(y1, d->un_y1);
+  _display_put(d, d->shown, dx0, dy0, dx1 - dx0, dy1 - dy0);
   return 1;
 }
 
-display_t *display_resize(display_t *d, const char *title, const int w, const int h)
+/* resize the buffers to w x h pixels. they are only reallocated when they grow,
+ * so the pointers in buffer may change, and nobody may write them meanwhile.
+ * returns non-zero if out of memory. */
+int display_resize(display_t *d, const int w, const int h)
 {
-  return d;
+  display_wait(d);
+  d->width = w;
+  d->height = h;
+  if ((size_t)w * h > d->capacity)
+  {
+    _display_free(d);
+    if (_display_alloc(d))
+    {
+      d->isShuttingDown = 1;
+      return 1;
+    }
+    return 0;
+  }
+  for(int k=0;k<DISPLAY_BUFFERS && d->image[0];k++)
+  {
+    d->image[k]->width = w;
+    d->image[k]->height = h;
+    d->image[k]->bytes_per_line = w * sizeof(uint32_t);
+  }
+  // the overlay is laid out for the new row length
+  memset(d->overlay, 0, d->capacity);
+  d->ov_x0 = d->ov_y0 = d->ov_x1 = d->ov_y1 = 0;
+  d->un_x0 = d->un_y0 = d->un_x1 = d->un_y1 = 0;
+  d->overlay_dirty = 1;
+  d->shown = -1;
+  return 0;
+}
+
+// ask the window manager for (or out of) fullscreen, the new size comes as ConfigureNotify
+void display_fullscreen(display_t *d, const int on)
+{
+  if (d->headless) return;
+  XEvent event;
+  memset(&event, 0, sizeof(event));
+  event.xclient.type = ClientMessage;
+  event.xclient.window = d->window;
+  event.xclient.message_type = XInternAtom(d->display, "_NET_WM_STATE", False);
+  event.xclient.format = 32;
+  event.xclient.data.l[0] = on ? 1 : 0; // _NET_WM_STATE_ADD or _REMOVE
+  event.xclient.data.l[1] = XInternAtom(d->display, "_NET_WM_STATE_FULLSCREEN", False);
+  event.xclient.data.l[3] = 1;          // from a normal application
+  XSendEvent(d->display, DefaultRootWindow(d->display), False,
+      SubstructureRedirectMask | SubstructureNotifyMask, &event);
+  XFlush(d->display);
+  d->fullscreen = on;
 }
 
 void display_title(display_t *d, const char *title)
 {
+  if (d->headless) return;
   XStoreName(d->display, d->window, title);
 }
 
 void display_print(display_t *d, const int px, const int py, const char *msg, ...)
 {
+  char buf[sizeof(d->msg)];
   va_list ap;
   va_start(ap, msg);
-  vsnprintf(d->msg, sizeof(d->msg), msg, ap);
+  vsnprintf(buf, sizeof(buf), msg, ap);
   // vprintf(msg, ap);
   // printf("\n");
   va_end(ap);
+  if (!strcmp(buf, d->msg) && d->msg_x == px && d->msg_y == py + 15) return;
+  memcpy(d->msg, buf, sizeof(d->msg));
   d->msg_len = strlen(d->msg);
   d->msg_x = px;
   d->msg_y = py + 15;
+  d->overlay_dirty = 1;
 }
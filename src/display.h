@@ -7,6 +7,7 @@
 #include <X11/Xutil.h>
 #include <X11/keysymdef.h>
 #include <X11/XKBlib.h>
+#include <X11/extensions/XShm.h>
 
 // get event declarations
 #include "display_common.h"
@@ -24,6 +25,15 @@ typedef enum display_mod_state_t
 }
 display_mod_state_t;
 
+// frames in flight: one on screen, one finished, one being rendered
+#define DISPLAY_BUFFERS 3
+// frames are uploaded at most this often per second, newer ones replace them meanwhile
+#define DISPLAY_REFRESH 60.0
+// while the window is resized, the buffers follow at most this often, in seconds
+#define DISPLAY_RESIZE_INTERVAL 0.1
+// a headless script waiting for frames goes on after this many seconds without one
+#define DISPLAY_SCRIPT_IDLE 1.0
+
 typedef struct display_t
 {
 	int isShuttingDown;
@@ -38,10 +48,59 @@ typedef struct display_t
 	Atom wmDeleteWindow;
   Display* display;
   Window window;
-  XImage* image;
   GC gc;
-  uint32_t *buffer;
+  Visual *visual;
+  int depth;
   int bit_depth;
+  int fullscreen;
+
+  // frames to upload, in the pixel layout of the visual
+  XImage* image[DISPLAY_BUFFERS];
+  uint32_t *buffer[DISPLAY_BUFFERS];
+  size_t capacity;     // pixels allocated per buffer, they only grow
+  int shift[3];        // bit offsets of red, green and blue in a pixel
+  int bits;            // bits per channel
+  int shown;           // buffer on screen, -1 if none
+  uint32_t text_fg;    // text colour in that layout
+  uint32_t text_dim;   // mask darkening the background of text
+
+  // the message, laid out once per change: 0 image, 1 darkened, 2 text
+  uint8_t *overlay;
+  int ov_x0, ov_y0, ov_x1, ov_y1; // rectangle it covers
+  int overlay_dirty;   // the message changed since
+  uint32_t *under;     // image under the overlay on screen
+  int un_x0, un_y0, un_x1, un_y1; // and where that is
+
+  // mit-shm: the images live in memory shared with a local x server
+  XShmSegmentInfo shm[DISPLAY_BUFFERS];
+  int use_shm;         // zero for remote displays, we fall back to XPutImage
+  int shm_completion;  // event type the server sends when done reading
+  int shm_busy;        // an upload is in flight, don't touch the buffer
+
+  // pointer motion, folded until the event queue is drained
+  mouse_t mouse;       // latest position
+  int moved;           // and it was not handed to onMouseMove yet
+  // window size, folded the same way and applied at most every DISPLAY_RESIZE_INTERVAL
+  int resize_w, resize_h;
+  int resized;
+  double last_resize;
+
+  // counters
+  uint64_t num_events; // events handled
+  uint64_t num_dropped;// motion events replaced by later ones
+  uint64_t num_frames; // frames uploaded
+  double frame_time;   // moving average of the time between uploads, in seconds
+  double last_frame;   // when the last frame was uploaded
+  double busy_time;    // time between frames that came less than DISPLAY_SCRIPT_IDLE apart
+  uint64_t busy_frames;// and how many those were
+
+  // headless: no window, the events come from a script
+  int headless;
+  FILE *script;
+  int script_line;     // line number, for errors
+  double script_until; // the script waits until then
+  uint64_t script_frames; // and until this many frames were uploaded
+  unsigned int script_buttons; // mouse buttons held down
 
   display_mod_state_t mod_state;
   // return value: 0 nothing 1 redraw -1 quit
@@ -52,14 +111,25 @@ typedef struct display_t
   int (*onMouseButtonDown)(mouse_t*);
   int (*onMouseMove)(mouse_t*);
   int (*onClose)();
+  // the window is now w x h, the app calls display_resize once nobody uses the buffers
+  int (*onResize)(int w, int h);
 }
 display_t;
 
 display_t *display_open(const char title[], int width, int height);
-int display_update(display_t *d, uint8_t *pixels);
+display_t *display_open_headless(const char *script, int width, int height);
+// upload one of the buffers, with the message on top
+int display_update(display_t *d, uint32_t *pixels);
+int display_update_overlay(display_t *d);
+// wait until the server is done reading the last upload, before the buffer is written again
+void display_wait(display_t *d);
 void display_close(display_t *d);
+int display_resize(display_t *d, const int w, const int h);
+void display_fullscreen(display_t *d, const int on);
 int display_pump_events(display_t *d);
 int display_wait_event(display_t *d);
+int display_poll(display_t *d, const int fd, const double timeout);
+double display_pace(const display_t *d);
 void display_print(display_t *d, const int px, const int py, const char* msg, ...);
 static inline void display_print_usage() {}
 void display_title(display_t *d, const char *title);
@@ -1,7 +1,9 @@
 #pragma once
 
 #include "fileinput.h"
+#include "render.h"
 #include "display.h"
+#include "play.h"
 
 #include <stdlib.h>
 #include <math.h>
@@ -11,7 +13,10 @@
 // this is true on a dvorak keyboard, where these are on the left homerow, middle + index fingers.
 // you might want to rename it to `df' on a qwerty keyboard:
 #define PROG_NAME "eu"
-#define PROG_VERSION 2
+#define PROG_VERSION 4
+
+// default frame rate of play mode
+#define EU_PLAY_FPS 24
 
 typedef struct eu_gui_state_t
 {
@@ -34,11 +39,22 @@ typedef struct eu_t
 {
   display_t *display;
   int num_files;
+  fileinput_prober_t prober;    // reads the headers of the files in the background
   int current_file;
   fileinput_t *file;
   fileinput_conversion_t conv;
+  threads_t threads;
+  lut_t lut;
 
-  uint8_t *pixels;
+  render_t render;              // render thread
+  const render_frame_t *shown;  // frame on screen
+  int begin, end;               // play range, inclusive
+  int fill;                     // render the play range ahead into the ram cache
+  play_t play;                  // playback clock
+  int step;                     // direction of the last step through the frames, +1 or -1
+  int step_flagged;             // and if it jumped between flagged frames
+  int window;                   // frames ahead whose pages are kept in memory
+  keycode_t fit;                // zoom to fit or fill once the size of the current frame is known, 0 for none
   eu_gui_state_t gui;
 }
 eu_t;
@@ -83,6 +99,16 @@ static inline int eu_load_profile(eu_t *eu, const char *filename)
 
 static inline int eu_init(eu_t *eu, int wd, int ht, int argc, char *arg[])
 {
+  // default display profile, used for the custom output color space:
+  char profile[1024];
+  snprintf(profile, sizeof(profile), "%s/.config/eu/display.icc", getenv("HOME"));
+  const char *profile_file = profile;
+  const char *script = 0;
+  double fps = EU_PLAY_FPS;
+  int window = RENDER_WINDOW;
+  size_t populate = 0; // files up to this size are read in whole when opened
+  ssize_t cache = -1;  // bytes of the ram cache, -1 for the default
+
   // find dimensions of window:
   for(int k=1;k<argc;k++)
   {
@@ -94,9 +120,37 @@ static inline int eu_init(eu_t *eu, int wd, int ht, int argc, char *arg[])
     {
       if(++k < argc) ht = atol(arg[k]);
     }
+    else if(!strcmp(arg[k], "-c"))
+    {
+      if(++k < argc) profile_file = arg[k];
+    }
+    else if(!strcmp(arg[k], "-H"))
+    {
+      if(++k < argc) script = arg[k];
+    }
+    else if(!strcmp(arg[k], "-f"))
+    {
+      if(++k < argc) fps = atof(arg[k]);
+    }
+    else if(!strcmp(arg[k], "-a"))
+    {
+      if(++k < argc) window = atol(arg[k]);
+    }
+    else if(!strcmp(arg[k], "-P"))
+    {
+      if(++k < argc) populate = MAX(0.0, atof(arg[k]))*1e6;
+    }
+    else if(!strcmp(arg[k], "-C"))
+    {
+      if(++k < argc) cache = MAX(0.0, atof(arg[k]))*1e6;
+    }
   }
 
   memset(&eu->gui, 0, sizeof(eu_gui_state_t));
+  play_init(&eu->play, fps > 0.0 ? fps : EU_PLAY_FPS);
+  eu->step = 1;
+  eu->step_flagged = 0;
+  eu->window = CLAMP(window, RENDER_AHEAD, RENDER_WINDOW_MAX);
 
   eu->conv.verbosity = s_silent;
 
@@ -107,50 +161,71 @@ static inline int eu_init(eu_t *eu, int wd, int ht, int argc, char *arg[])
   eu->conv.gamutmap = s_gamut_clamp;
   eu->conv.curve = s_none;
   eu->conv.channels = s_rgb;
+  eu->conv.filter = s_filter_mitchell;
   eu->conv.roi_out.w = wd;
   eu->conv.roi_out.h = ht;
 
   eu_load_profile(eu, "eurc");
 
+  // worker pool for grab and batch processing, lives as long as we do
+  threads_init(&eu->threads, 0);
+  lut_init(&eu->lut, profile_file);
+
+  float batch_scale = 1.0f;
+  fileinput_pool_init(populate);
   eu->num_files = 0;
   eu->file = (fileinput_t *)aligned_alloc(16, (argc-1)*sizeof(fileinput_t));
   eu->gui.batch = 0;
   for(int k=1;k<argc;k++)
   {
-    if(!strcmp(arg[k], "-w") || !strcmp(arg[k], "-h"))
+    if(!strcmp(arg[k], "-w") || !strcmp(arg[k], "-h") || !strcmp(arg[k], "-c") || !strcmp(arg[k], "-H") || !strcmp(arg[k], "-f") || !strcmp(arg[k], "-a") || !strcmp(arg[k], "-P") || !strcmp(arg[k], "-C"))
     {
       k++;
     }
     else if(!strcmp(arg[k], "-p") && k+1 < argc) eu_load_profile(eu, arg[++k]);
+    else if(!strcmp(arg[k], "-s") && k+1 < argc) batch_scale = atof(arg[++k]);
     else if(!strcmp(arg[k], "-o"))
     {
       k++;
       assert(eu->num_files > 0);
       if(k < argc)
-        fileinput_process(eu->file, &eu->conv, arg[k]);
+        fileinput_process(eu->file, &eu->conv, &eu->threads, &eu->lut, batch_scale, arg[k]);
       eu->gui.batch = 1;
     }
-    else
-    {
-      if(fileinput_open(eu->file+eu->num_files, arg[k]))
-      {
-        // just go on with empty frames.
-        fprintf(stderr, "[eu_init] could not open file `%s'\n", arg[k]);
-      }
-      else eu->num_files ++;
-    }
+    else // nothing is read yet, files that can't be opened are shown as empty frames
+      fileinput_init(eu->file + eu->num_files++, arg[k]);
   }
+  // the first frame that can be opened is shown right away
+  int first = 0;
+  while(first < eu->num_files - 1 && fileinput_probe(eu->file + first)) first++;
 
-  if(!eu->gui.batch) eu->display = display_open(PROG_NAME, wd, ht);
-  else eu->display = 0;
+  if(eu->gui.batch) eu->display = 0;
+  else if(script) eu->display = display_open_headless(script, wd, ht);
+  else eu->display = display_open(PROG_NAME, wd, ht);
+  if(!eu->gui.batch && !eu->display) return 1; // nothing to show on
+  // render straight into the pixel layout of the display
+  eu->conv.format = kernel_format_xrgb8;
+  if(eu->display)
+  {
+    for(int k=0;k<3;k++) eu->conv.format.shift[k] = eu->display->shift[k];
+    eu->conv.format.bits = eu->display->bits;
+  }
 
 
   // use dimensions of first file
-  eu->conv.roi.w = fileinput_width(eu->file);
-  eu->conv.roi.h = fileinput_height(eu->file);
-  eu->current_file = 0;
+  eu->conv.roi.w = fileinput_width(eu->file + first);
+  eu->conv.roi.h = fileinput_height(eu->file + first);
+  eu->current_file = first;
+  eu->begin = 0;
+  eu->end = eu->num_files - 1;
+  eu->fill = 0;
+  eu->fit = 0;
+  eu->shown = 0;
 
-  eu->pixels = (uint8_t *)aligned_alloc(16, wd*ht*3);
+  if(!eu->gui.batch && render_init(&eu->render, eu->file, eu->num_files, &eu->threads, &eu->lut, cache, wd, ht, eu->display ? eu->display->buffer : 0))
+    fprintf(stderr, "[eu_init] could not start the render thread\n");
+  // the headers of all others in the background
+  if(!eu->gui.batch) fileinput_prober_start(&eu->prober, eu->file, eu->num_files);
   return eu->gui.batch;
 }
 
@@ -174,10 +249,17 @@ static inline void eu_cleanup(eu_t *eu)
       fclose(f);
     }
   }
+  fileinput_prober_stop(&eu->prober);
+  if(eu->display) render_cleanup(&eu->render); // started along with the display
   for(int k=0;k<eu->num_files;k++)
     fileinput_close(eu->file+k);
+  fileinput_reader_cleanup();
+  if(eu->play.shown)
+    fprintf(stderr, "[play] %lu frames shown, %lu dropped\n",
+        (unsigned long)eu->play.shown, (unsigned long)eu->play.dropped);
   display_close(eu->display);
-  free(eu->pixels);
+  threads_cleanup(&eu->threads);
+  lut_cleanup(&eu->lut);
   free(eu->file);
 }
 
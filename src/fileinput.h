@@ -1,6 +1,12 @@
 #pragma once
 #include "transform.h"
 #include "framebuffer.h"
+#include "threads.h"
+#include "kernel.h"
+#include "lut.h"
+#include "mip.h"
+#include "resample.h"
+#include "uring.h"
 
 #include <assert.h>
 #include <math.h>
@@ -16,6 +22,8 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 typedef enum fileinput_verbosity_t
 {
@@ -28,7 +36,8 @@ fileinput_verbosity_t;
 typedef struct fileinput_roi_t
 {
   float scale;
-  int x, y, w, h;
+  float x, y; // not rounded, so drags move the view by whole output pixels at any scale
+  int w, h;
 }
 fileinput_roi_t;
 
@@ -43,6 +52,8 @@ typedef struct fileinput_conversion_t
   transform_gamut_t    gamutmap;   // gamut mapping
   fileinput_roi_t      roi;        // region of interest. first scale input, then crop to int bounds
   fileinput_roi_t      roi_out;    // output buffer description
+  kernel_format_t      format;     // pixel layout of the output buffer
+  resample_filter_t    filter;     // resampling filter for scaled output
 
   fileinput_verbosity_t verbosity; // control log output to stderr
 }
@@ -55,112 +66,554 @@ typedef enum fileinput_type_t
 }
 fileinput_type_t;
 
-/* struct encapsulating all pfm specific stuff */
-typedef struct fileinput_pfm_t
+// files are opened lazily, the header is read by whichever thread needs it first
+typedef enum fileinput_state_t
 {
-  int width, height;     // dimensions of the image
-  float *scale;          // optional scale read from end of file
-  float *pixel;          // pointer to start of pixel data
+  s_file_new = 0,      // nothing read yet
+  s_file_probing,      // a thread is reading the header
+  s_file_ready,        // header known, the pixels can be mapped
+  s_file_dead,         // could not be opened or is no image, shown black
 }
-fileinput_pfm_t;
+fileinput_state_t;
 
-/* input file buffer type. */
+/* input file buffer type. the header fields are valid once the state is ready. */
 typedef struct fileinput_t
 {
-  int fd;              // file descriptor
-  void *data;          // mapped buffer
+  atomic_int state;    // fileinput_state_t
+  int fd;              // file descriptor, -1 while closed
+  void *data;          // mapped file, null while not mapped
   size_t data_size;    // size of file
   char filename[1024]; // buffer file name
 
   int flag;            // flagged for comparison?
 
   fileinput_type_t format;
+  int width, height;   // dimensions of the image
+  int channels;        // floats per pixel
+  size_t offset;       // of the pixels in the file
+  float gain;          // scale from the end of the pfm or from the fb header
 
-  fileinput_pfm_t pfm; // pfm file
-  framebuffer_t fb;    // framebuffer file
+  struct fileinput_t *prev, *next; // list of open files, see fileinput_pool_t
+
+  mip_t mip;           // downscaled copies for zoomed out views
+  int resident;        // pages were read or asked for, and not dropped since
+  int advice;          // access pattern given to the mapping (MADV_*), -1 for none yet
 }
 fileinput_t;
 
-/* wrappers to get dimensions, for future format extension. */
-static inline int fileinput_width(fileinput_t *in)
+// memory all mip pyramids together may hold before the least recently used are dropped
+#define FILEINPUT_MIP_BUDGET (1ul<<30)
+// descriptors left for everything else
+#define FILEINPUT_RESERVED_FDS 64
+// fb files at least this large are worth backing with huge pages, fewer tlb misses in grab
+#define FILEINPUT_HUGE (64ul<<20)
+// seconds the gui thread waits for a header another thread reads, before it goes on without
+#define FILEINPUT_PROBE_WAIT 0.01
+
+/* all files that have a descriptor or a mapping, in a list with the most recently
+ * used first. both are limited, descriptors by RLIMIT_NOFILE and mappings by
+ * vm.max_map_count: the least recently used are closed or unmapped to stay below,
+ * and opened again when they are needed. headers are read on several threads, but
+ * only one thread (the render thread, or the main thread in batch mode) maps. */
+typedef struct fileinput_pool_t
 {
-  if(in->format == s_pfm)
-    return in->pfm.width;
-  return in->fb.header->width;
+  pthread_mutex_t mutex;       // guards the list and the counts
+  fileinput_t *head, *tail;
+  int fds, max_fds;            // descriptors open, and how many we may have
+  int maps, max_maps;          // files mapped, and how many may be
+  size_t populate;             // files up to this size are read in whole right away
 }
+fileinput_pool_t;
 
-static inline int fileinput_height(fileinput_t *in)
+static fileinput_pool_t _fileinput_pool = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+/* find the limits, before any file is opened. files of at most populate bytes are
+ * read in whole as soon as their header is known, and mapped with MAP_POPULATE. */
+static inline void fileinput_pool_init(const size_t populate)
 {
-  if(in->format == s_pfm)
-    return in->pfm.height;
-  return in->fb.header->height;
+  fileinput_pool_t *p = &_fileinput_pool;
+  p->populate = populate;
+  // descriptors are limited per process, ask for all we are allowed to
+  struct rlimit rl;
+  p->max_fds = 1024;
+  if(!getrlimit(RLIMIT_NOFILE, &rl))
+  {
+    if(rl.rlim_cur < rl.rlim_max)
+    {
+      rl.rlim_cur = rl.rlim_max;
+      if(setrlimit(RLIMIT_NOFILE, &rl)) getrlimit(RLIMIT_NOFILE, &rl);
+    }
+    p->max_fds = rl.rlim_cur > (1u<<20) ? (1<<20) : (int)rl.rlim_cur;
+  }
+  p->max_fds = MAX(16, p->max_fds - FILEINPUT_RESERVED_FDS);
+  // the other half of the mappings for libraries, threads and allocations
+  int maps = 65530;
+  FILE *f = fopen("/proc/sys/vm/max_map_count", "r");
+  if(f)
+  {
+    if(fscanf(f, "%d", &maps) != 1) maps = 65530;
+    fclose(f);
+  }
+  p->max_maps = MAX(16, maps/2);
 }
 
-/* unmap the file. */
-static inline void fileinput_close(fileinput_t *in)
+static inline void _fileinput_pool_unlink(fileinput_pool_t *p, fileinput_t *in)
 {
-  if(in->format == s_fb) fb_cleanup(&in->fb);
-  if(in->data) munmap(in->data, in->data_size);
-  if(in->fd > 2) close(in->fd);
-  in->fd = -1;
+  if(in->prev) in->prev->next = in->next;
+  else if(p->head == in) p->head = in->next;
+  else return; // not in the list
+  if(in->next) in->next->prev = in->prev;
+  else p->tail = in->prev;
+  in->prev = in->next = 0;
 }
 
-/* open input file via mmap, to not consume any memory if we don't need it. */
-static inline int fileinput_open(fileinput_t *in, const char *filename)
+// move in to the front of the list
+static inline void _fileinput_pool_touch(fileinput_pool_t *p, fileinput_t *in)
 {
-  in->flag = 0;
-  in->data = 0;
+  _fileinput_pool_unlink(p, in);
+  in->next = p->head;
+  if(p->head) p->head->prev = in;
+  p->head = in;
+  if(!p->tail) p->tail = in;
+}
 
-  if(!fb_map(&in->fb, filename))
-  { // first try to map as fb
-    in->format = s_fb;
-    return 0;
+// close descriptors or unmap files from the least recently used end until there is room for one more
+static inline void _fileinput_pool_evict(fileinput_pool_t *p, const fileinput_t *keep, const int fds, const int maps)
+{
+  fileinput_t *f = p->tail;
+  while(f && ((fds && p->fds >= p->max_fds) || (maps && p->maps >= p->max_maps)))
+  {
+    fileinput_t *prev = f->prev;
+    if(f != keep)
+    {
+      if(fds && p->fds >= p->max_fds && f->fd >= 0)
+      {
+        close(f->fd);
+        f->fd = -1;
+        p->fds--;
+      }
+      if(maps && p->maps >= p->max_maps && f->data)
+      {
+        munmap(f->data, f->data_size);
+        f->data = 0;
+        f->advice = -1;
+        p->maps--;
+      }
+      if(f->fd < 0 && !f->data) _fileinput_pool_unlink(p, f);
+    }
+    f = prev;
   }
+}
 
-  in->format = s_pfm;
-  in->fd = open(filename, O_RDONLY);
-  (void)strncpy(in->filename, filename, 1024);
-  if(in->fd == -1) return 1;
-  in->data_size = lseek(in->fd, 0, SEEK_END);
-  if(in->data_size < 100)
+/* parse the header at the start of the file, len bytes of it in head. */
+static inline int _fileinput_header(fileinput_t *in, const char *head, const ssize_t len)
+{
+  framebuffer_header_t fb;
+  if(len >= (ssize_t)sizeof(fb))
   {
-    fileinput_close(in);
-    return 2;
+    memcpy(&fb, head, sizeof(fb));
+    if(!fb_header_check(&fb, in->data_size))
+    { // it's an fb
+      in->format = s_fb;
+      in->width = fb.width;
+      in->height = fb.height;
+      in->channels = fb.channels;
+      in->gain = fb.gain;
+      in->offset = sizeof(fb);
+      return 0;
+    }
   }
-  lseek(in->fd, 0, SEEK_SET);
-  // this will cause segfaults in case anybody else is writing it while we have it mapped
-  in->data = mmap(0, in->data_size, PROT_READ, MAP_SHARED | MAP_NORESERVE, in->fd, 0);
+  if(in->data_size < 100 || len < 100) return 2;
 
-  // get pfm header for faster grabbing later on.
-  // no error handling is done, no comments supported.
+  // pfm header, no error handling is done, no comments supported.
+  in->format = s_pfm;
+  in->channels = 3;
   char *endptr;
-  in->pfm.width = strtol(in->data+3, &endptr, 10);
-  in->pfm.height = strtol(endptr, &endptr, 10);
+  in->width = strtol(head+3, &endptr, 10);
+  in->height = strtol(endptr, &endptr, 10);
   endptr++; // remove newline
-  while(endptr < (char *)in->data + 100 && *endptr != '\n') endptr++;
-  in->pfm.pixel = (float*)(++endptr); // remove second newline
+  while(endptr < head + 100 && *endptr != '\n') endptr++;
+  in->offset = ++endptr - head; // remove second newline
+  in->gain = 1.0f;
 
-  // got extra data at the end?
-  in->pfm.scale = 0;
-  if(in->data_size - sizeof(float)*(in->pfm.pixel - (float *)in->data) > sizeof(float)*3*in->pfm.width*in->pfm.height)
-    in->pfm.scale = in->pfm.pixel + in->pfm.width * in->pfm.height * 3;
+  // sanity check:
+  if(in->width <= 0 || in->height <= 0 ||
+     in->width*(uint64_t)in->height*3*sizeof(float) > in->data_size - in->offset)
+    return 3;
 
   // while writing make sure the pixel data is 16-byte aligned for sse.
   // achieve this by padding up the idiotic scale factor line in the header with additional 0s
-  if((size_t)in->pfm.pixel & 0xf)
-    fprintf(stderr, "[fileinput_open] `%s' pixel buffer not SSE aligned!\n", filename);
-  if((size_t)in->pfm.pixel & 0x3)
-    fprintf(stderr, "[fileinput_open] `%s' pixel buffer not float aligned!\n", filename);
+  if(in->offset & 0xf)
+    fprintf(stderr, "[fileinput_probe] `%s' pixel buffer not SSE aligned!\n", in->filename);
+  if(in->offset & 0x3)
+    fprintf(stderr, "[fileinput_probe] `%s' pixel buffer not float aligned!\n", in->filename);
+  return 0;
+}
 
-  // sanity check:
-  if(in->pfm.width*in->pfm.height*3*sizeof(float) > in->data_size - (endptr - (char *)in->data))
+// open the file and read its header
+static inline int _fileinput_probe(fileinput_t *in)
+{
+  fileinput_pool_t *p = &_fileinput_pool;
+  const int fd = open(in->filename, O_RDONLY);
+  if(fd == -1) return 1;
+  struct stat st;
+  char head[128];
+  const ssize_t len = fstat(fd, &st) ? -1 : pread(fd, head, sizeof(head) - 1, 0);
+  int err = len < 0;
+  if(!err)
   {
-    fileinput_close(in);
-    return 3;
+    head[len] = 0;
+    in->data_size = st.st_size;
+    err = _fileinput_header(in, head, len);
+  }
+  // got extra data at the end?
+  const size_t end = in->offset + sizeof(float)*3*in->width*(uint64_t)in->height;
+  if(!err && in->format == s_pfm && in->data_size >= end + sizeof(float) &&
+      pread(fd, &in->gain, sizeof(float), end) != sizeof(float))
+    in->gain = 1.0f;
+  if(err)
+  {
+    close(fd);
+    return err;
+  }
+  if(in->data_size <= p->populate) posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+  // keep the descriptor to map the file later, if there is room
+  pthread_mutex_lock(&p->mutex);
+  if(p->fds < p->max_fds)
+  {
+    in->fd = fd;
+    p->fds++;
+    _fileinput_pool_touch(p, in);
   }
+  else close(fd);
+  pthread_mutex_unlock(&p->mutex);
   return 0;
 }
 
+// signalled whenever a header was read, for the threads waiting on one
+static pthread_mutex_t _fileinput_probe_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _fileinput_probe_cond = PTHREAD_COND_INITIALIZER;
+
+/* wait until the header is read by another thread, for at most wait seconds
+ * (forever if negative). returns the state. */
+static inline int _fileinput_probe_wait(fileinput_t *in, const double wait)
+{
+  int s = atomic_load(&in->state);
+  if(s == s_file_ready || s == s_file_dead || wait == 0.0) return s;
+  struct timespec until;
+  clock_gettime(CLOCK_REALTIME, &until);
+  const double ns = until.tv_nsec + (wait > 0.0 ? wait : 0.0)*1e9;
+  until.tv_sec += (time_t)(ns*1e-9);
+  until.tv_nsec = (long)(ns - 1e9*(time_t)(ns*1e-9));
+  pthread_mutex_lock(&_fileinput_probe_mutex);
+  while((s = atomic_load(&in->state)) == s_file_probing || (wait > 0.0 && s == s_file_new))
+  {
+    if(wait < 0.0) pthread_cond_wait(&_fileinput_probe_cond, &_fileinput_probe_mutex);
+    else if(pthread_cond_timedwait(&_fileinput_probe_cond, &_fileinput_probe_mutex, &until)) break;
+  }
+  pthread_mutex_unlock(&_fileinput_probe_mutex);
+  return atomic_load(&in->state);
+}
+
+/* read the header of the file unless that happened already. if another thread is
+ * reading it, wait for it. returns non-zero for dead frames. */
+static inline int fileinput_probe(fileinput_t *in)
+{
+  int s = atomic_load(&in->state);
+  if(s == s_file_new && atomic_compare_exchange_strong(&in->state, &s, s_file_probing))
+  {
+    s = _fileinput_probe(in) ? s_file_dead : s_file_ready;
+    if(s == s_file_dead) fprintf(stderr, "[fileinput_probe] could not open file `%s'\n", in->filename);
+    pthread_mutex_lock(&_fileinput_probe_mutex);
+    atomic_store(&in->state, s);
+    pthread_cond_broadcast(&_fileinput_probe_cond);
+    pthread_mutex_unlock(&_fileinput_probe_mutex);
+  }
+  if(s == s_file_probing) s = _fileinput_probe_wait(in, -1.0);
+  return s != s_file_ready;
+}
+
+/* for the gui thread, which doesn't read files: non-zero while the header is not
+ * known yet. waits at most wait seconds for the prober or the render thread to read it. */
+static inline int fileinput_pending(fileinput_t *in, const double wait)
+{
+  const int s = _fileinput_probe_wait(in, wait);
+  return s != s_file_ready && s != s_file_dead;
+}
+
+/* wrappers to get dimensions, for future format extension. dead frames and frames
+ * whose header was not read yet are 0x0, these never read the file. */
+static inline int fileinput_width(fileinput_t *in)
+{
+  return atomic_load(&in->state) == s_file_ready ? in->width : 0;
+}
+
+static inline int fileinput_height(fileinput_t *in)
+{
+  return atomic_load(&in->state) == s_file_ready ? in->height : 0;
+}
+
+/* the descriptor of the file, opened again if it was closed to make room, or -1. */
+static inline int fileinput_fd(fileinput_t *in)
+{
+  if(fileinput_probe(in)) return -1;
+  fileinput_pool_t *p = &_fileinput_pool;
+  pthread_mutex_lock(&p->mutex);
+  if(in->fd < 0)
+  {
+    _fileinput_pool_evict(p, in, 1, 0);
+    in->fd = open(in->filename, O_RDONLY);
+    if(in->fd >= 0) p->fds++;
+  }
+  if(in->fd >= 0) _fileinput_pool_touch(p, in);
+  pthread_mutex_unlock(&p->mutex);
+  return in->fd;
+}
+
+/* map the file unless it is, unmapping others if there are too many. returns
+ * non-zero for dead frames. */
+static inline int fileinput_map(fileinput_t *in)
+{
+  fileinput_pool_t *p = &_fileinput_pool;
+  if(fileinput_probe(in)) return 1;
+  if(in->data)
+  {
+    pthread_mutex_lock(&p->mutex);
+    _fileinput_pool_touch(p, in);
+    pthread_mutex_unlock(&p->mutex);
+    return 0;
+  }
+  const int fd = fileinput_fd(in);
+  if(fd < 0) return 1;
+  pthread_mutex_lock(&p->mutex);
+  _fileinput_pool_evict(p, in, 0, 1);
+  pthread_mutex_unlock(&p->mutex);
+  // this will cause segfaults in case anybody else is writing it while we have it mapped
+  const int populate = in->data_size <= p->populate ? MAP_POPULATE : 0;
+  void *data = mmap(0, in->data_size, PROT_READ, MAP_SHARED | MAP_NORESERVE | populate, fd, 0);
+  if(data == MAP_FAILED) return 1;
+#ifdef MADV_HUGEPAGE
+  if(in->format == s_fb && in->data_size >= FILEINPUT_HUGE) madvise(data, in->data_size, MADV_HUGEPAGE);
+#endif
+  pthread_mutex_lock(&p->mutex);
+  in->data = data;
+  p->maps++;
+  _fileinput_pool_touch(p, in);
+  pthread_mutex_unlock(&p->mutex);
+  return 0;
+}
+
+// the pixels of the mapped file
+static inline const float *fileinput_pixels(const fileinput_t *in)
+{
+  return (const float *)((const uint8_t *)in->data + in->offset);
+}
+
+// the pixels, mapped first if needed, or null
+static inline const float *_fileinput_mapped_pixels(fileinput_t *in)
+{
+  return fileinput_map(in) ? 0 : fileinput_pixels(in);
+}
+
+// the whole mapping of the file, size 0 if it is not mapped
+static inline void *_fileinput_mapping(const fileinput_t *in, size_t *size)
+{
+  *size = in->data ? in->data_size : 0;
+  return in->data;
+}
+
+/* optional reader that copies the rows a frame needs into buffers of our own with
+ * large io_uring reads, instead of faulting in the pages of the mapping one by one.
+ * EU_READER=mmap|uring|direct selects it, direct bypasses the page cache with
+ * O_DIRECT. the batch mode always samples the mapping. */
+typedef enum fileinput_reader_mode_t
+{
+  s_reader_mmap = 0,   // sample the mapping directly
+  s_reader_uring,      // read into buffers through the page cache
+  s_reader_direct,     // read into buffers, bypassing the page cache
+  s_reader_cnt,
+}
+fileinput_reader_mode_t;
+
+static const char *fileinput_reader_name[] = {"mmap", "uring", "direct"};
+
+// buffers kept around, so redraws of the last few frames don't read again
+#define FILEINPUT_READER_SLOTS 4
+// alignment of buffers, offsets and sizes for O_DIRECT
+#define FILEINPUT_READER_ALIGN 4096ul
+// O_DIRECT is only declared with _GNU_SOURCE
+#if defined(O_DIRECT)
+#define FILEINPUT_O_DIRECT O_DIRECT
+#elif defined(__O_DIRECT)
+#define FILEINPUT_O_DIRECT __O_DIRECT
+#else
+#define FILEINPUT_O_DIRECT 0
+#endif
+
+typedef struct fileinput_reader_slot_t
+{
+  const fileinput_t *in;   // file the rows are from, null if the slot is free
+  int fd;                  // our own descriptor opened with O_DIRECT, -1 for none
+  int direct;              // read with O_DIRECT, until that failed once
+  int64_t y0, y1;          // rows in the buffer
+  size_t offset;           // of the row y0 in the buffer
+  uint8_t *buf;
+  size_t cap;              // bytes allocated
+  uint64_t used;           // for eviction
+}
+fileinput_reader_slot_t;
+
+typedef struct fileinput_reader_t
+{
+  fileinput_reader_mode_t mode;
+  uring_t ring;
+  fileinput_reader_slot_t slot[FILEINPUT_READER_SLOTS];
+  uint64_t clock;
+  size_t bytes;            // read so far
+  double time;             // spent reading
+}
+fileinput_reader_t;
+
+static fileinput_reader_t _fileinput_reader;
+static pthread_once_t _fileinput_reader_once = PTHREAD_ONCE_INIT;
+
+static inline void _fileinput_reader_init()
+{
+  fileinput_reader_t *r = &_fileinput_reader;
+  memset(r, 0, sizeof(*r));
+  for(int k=0;k<FILEINPUT_READER_SLOTS;k++) r->slot[k].fd = -1;
+  r->ring.fd = -1;
+  const char *mode = getenv("EU_READER");
+  if(mode)
+  {
+    int k = 0;
+    while(k < s_reader_cnt && strcmp(mode, fileinput_reader_name[k])) k++;
+    if(k == s_reader_cnt)
+      fprintf(stderr, "[reader] unknown EU_READER `%s', use mmap, uring or direct\n", mode);
+    else r->mode = k;
+  }
+  if(r->mode != s_reader_mmap && uring_init(&r->ring))
+    fprintf(stderr, "[reader] no io_uring, reading with pread\n");
+}
+
+/* the reader, set up from the environment once. safe to call from any thread, but
+ * the ring and the slots belong to the render thread that grabs the frames: the
+ * gui only forgets files and cleans up after the render thread was joined. */
+static inline fileinput_reader_t *fileinput_reader()
+{
+  pthread_once(&_fileinput_reader_once, _fileinput_reader_init);
+  return &_fileinput_reader;
+}
+
+static inline void _fileinput_reader_free(fileinput_reader_slot_t *s)
+{
+  if(s->fd >= 0) close(s->fd);
+  s->fd = -1;
+  s->in = 0;
+}
+
+/* forget the rows of in, it is closed. */
+static inline void fileinput_reader_forget(const fileinput_t *in)
+{
+  fileinput_reader_t *r = fileinput_reader();
+  for(int k=0;k<FILEINPUT_READER_SLOTS;k++)
+    if(r->slot[k].in == in) _fileinput_reader_free(r->slot + k);
+}
+
+/* release the buffers and the ring, and say how fast reading was. */
+static inline void fileinput_reader_cleanup()
+{
+  fileinput_reader_t *r = fileinput_reader();
+  if(r->mode == s_reader_mmap) return;
+  if(r->bytes)
+    fprintf(stderr, "[reader] %s: %.1f MB in %.3f s, %.0f MB/s\n", fileinput_reader_name[r->mode],
+        r->bytes/1e6, r->time, r->time > 0.0 ? r->bytes/1e6/r->time : 0.0);
+  for(int k=0;k<FILEINPUT_READER_SLOTS;k++)
+  {
+    _fileinput_reader_free(r->slot + k);
+    free(r->slot[k].buf);
+    r->slot[k].buf = 0;
+    r->slot[k].cap = 0;
+  }
+  uring_cleanup(&r->ring);
+}
+
+/* remember the file, nothing is read until it is needed. */
+static inline void fileinput_init(fileinput_t *in, const char *filename)
+{
+  memset(in, 0, sizeof(*in));
+  atomic_init(&in->state, s_file_new);
+  in->fd = -1;
+  in->advice = -1;
+  (void)strncpy(in->filename, filename, sizeof(in->filename) - 1);
+}
+
+/* unmap and close the file. */
+static inline void fileinput_close(fileinput_t *in)
+{
+  fileinput_pool_t *p = &_fileinput_pool;
+  fileinput_reader_forget(in);
+  mip_cleanup(&in->mip);
+  pthread_mutex_lock(&p->mutex);
+  if(in->data)
+  {
+    munmap(in->data, in->data_size);
+    p->maps--;
+  }
+  if(in->fd >= 0)
+  {
+    close(in->fd);
+    p->fds--;
+  }
+  in->data = 0;
+  in->fd = -1;
+  _fileinput_pool_unlink(p, in);
+  pthread_mutex_unlock(&p->mutex);
+}
+
+// threads reading headers in the background, they mostly wait for the disk or network
+#define FILEINPUT_PROBE_THREADS 8
+
+/* reads the headers of all files in the background, so the first frame can be
+ * shown right away. files needed earlier are read by whoever needs them. */
+typedef struct fileinput_prober_t
+{
+  fileinput_t *file;
+  int num;
+  atomic_int next;     // next file to look at
+  atomic_int quit;
+  pthread_t thread[FILEINPUT_PROBE_THREADS];
+  int num_threads;
+}
+fileinput_prober_t;
+
+static inline void *_fileinput_prober_run(void *arg)
+{
+  fileinput_prober_t *p = (fileinput_prober_t *)arg;
+  int k;
+  while(!atomic_load(&p->quit) && (k = atomic_fetch_add(&p->next, 1)) < p->num)
+    fileinput_probe(p->file + k);
+  return 0;
+}
+
+static inline void fileinput_prober_start(fileinput_prober_t *p, fileinput_t *file, const int num)
+{
+  p->file = file;
+  p->num = num;
+  atomic_init(&p->next, 0);
+  atomic_init(&p->quit, 0);
+  p->num_threads = 0;
+  for(int k=0;k<FILEINPUT_PROBE_THREADS && k<num;k++)
+    if(!pthread_create(p->thread + p->num_threads, 0, _fileinput_prober_run, p)) p->num_threads++;
+}
+
+static inline void fileinput_prober_stop(fileinput_prober_t *p)
+{
+  atomic_store(&p->quit, 1);
+  for(int k=0;k<p->num_threads;k++) pthread_join(p->thread[k], 0);
+  p->num_threads = 0;
+}
+
 static inline double _time_wallclock()
 {
   struct timeval time;
@@ -168,50 +621,116 @@ static inline double _time_wallclock()
   return time.tv_sec - 1290608000 + (1.0/1000000.0)*time.tv_usec;
 }
 
-static inline int fileinput_process(fileinput_t *in, const fileinput_conversion_t *c, const char *filename)
+// rows of output per task handed to the thread pool
+#define FILEINPUT_BAND_HEIGHT 16
+
+typedef struct fileinput_process_job_t
+{
+  const fileinput_conversion_t *c;
+  const lut_t *lut;
+  resample_t rs; // scaling to the output size
+  float f;       // combined gain and exposure
+  int row;       // first output row of this chunk
+  int num_rows;  // output rows in this chunk
+  float *out;    // converted rows of this chunk
+}
+fileinput_process_job_t;
+
+static inline void _fileinput_process_band(void *data, const int task)
+{
+  const fileinput_process_job_t *job = (const fileinput_process_job_t *)data;
+  const fileinput_conversion_t *c = job->c;
+  const int wd = job->rs.x.n;
+  const int r0 = task*FILEINPUT_BAND_HEIGHT, r1 = MIN(r0 + FILEINPUT_BAND_HEIGHT, job->num_rows);
+  float *soa = (float *)malloc(sizeof(float)*3*wd*(r1 - r0));
+  if(!soa || resample_rows(&job->rs, job->row + r0, job->row + r1, soa))
+  { // out of memory, leave the rows black
+    memset(job->out + 3*wd*r0, 0, sizeof(float)*3*wd*(r1 - r0));
+    free(soa);
+    return;
+  }
+  for(int r=r0; r<r1; r++)
+  {
+    const int j = job->row + r;
+    const float *rgb = soa + 3*wd*(r - r0);
+    float *out = job->out + 3*wd*r;
+    for(int i=0; i<wd; i++)
+    {
+      float *tmp = out + 3*i;
+      for(int k=0; k<3; k++) tmp[k] = rgb[k*wd + i];
+
+      // float exposure; adjust exposure
+      transform_exposure(tmp, job->f);
+
+      // color conversion, including the tone response of the output space
+      if(c->colorin != s_passthrough && c->colorout == s_custom)
+      { // display profile, evaluated exactly instead of through the 3d lut meant for the screen
+        const float *M = job->lut->profile.xyz_to_rgb;
+        float lin[3] = {0.0f};
+        for(int k=0;k<3;k++)
+          for(int l=0;l<3;l++) lin[k] += tmp[l]*M[3*k+l];
+        _lut3d_eval(&job->lut->profile, c->gamutmap, lin, tmp); // gamut maps all but the marks
+        if(c->gamutmap == s_gamut_mark) transform_gamutmap(tmp, c->gamutmap, wd*j + i);
+      }
+      else
+      {
+        transform_color(tmp, c->colorin, c->colorout, 0);
+        if(c->colorin != s_passthrough) transform_gamutmap(tmp, c->gamutmap, wd*j + i);
+      }
+
+      // not applying curve or channel zeroing.
+    }
+  }
+  free(soa);
+}
+
+/* write the file converted with c to a pfm, scaled by the factor scale using the resampling filter of c. */
+static inline int fileinput_process(fileinput_t *in, const fileinput_conversion_t *c, threads_t *t, lut_t *lut, const float scale, const char *filename)
 {
+  // skip dead frames
+  if(fileinput_map(in)) return 1;
   if(in->format != s_pfm) return 1; // TODO: use fb input, too
   fprintf(stderr, "[process] rendering `%s'\n", filename);
   FILE *out = fopen(filename, "wb");
   if(!out) return 1;
 
   double start = _time_wallclock();
-  // skip dead frames
-  if(in->fd < 0) return 1;
 
-  const float f = (in->pfm.scale ? in->pfm.scale[0] : 1.0f) * powf(2.0f, c->exposure);
+  const float f = in->gain * powf(2.0f, c->exposure);
+  const int wd = MAX(1, (int)(in->width*scale + .5f));
+  const int ht = MAX(1, (int)(in->height*scale + .5f));
 
   char header[1024];
-  snprintf(header, 1024, "PF\n%d %d\n-1.0", in->pfm.width, in->pfm.height);
+  snprintf(header, 1024, "PF\n%d %d\n-1.0", wd, ht);
   size_t len = strlen(header);
-  fprintf(out, "PF\n%d %d\n-1.0", in->pfm.width, in->pfm.height);
+  fprintf(out, "PF\n%d %d\n-1.0", wd, ht);
   ssize_t off = 0;
   while((len + 1 + off) & 0xf) off++;
   while(off-- > 0) fprintf(out, "0");
   fprintf(out, "\n");
 
-  for(int j=0; j<in->pfm.height; j++)
-  {
-    for(int i=0; i<in->pfm.width; i++)
-    {
-      float tmp[3];
-      for(int k=0; k<3; k++) tmp[k] = in->pfm.pixel[3*(in->pfm.width*j + i) + k];
-
-      // float exposure; adjust exposure
-      transform_exposure(tmp, f);
-
-      // color conversion
-      transform_color(tmp, c->colorin, c->colorout, 0);
-
-      // gamut mapping 
-      if(c->colorin != s_passthrough)
-        transform_gamutmap(tmp, c->gamutmap);
+  lut_update(lut, t, c->colorout, c->gamutmap, s_none);
 
-      // not applying curve or channel zeroing, outputting linear only.
-
-      fwrite(tmp, sizeof(float), 3, out);
-    }
+  // convert a chunk of rows in parallel, one band of rows per task, then write it in order
+  const int chunk = FILEINPUT_BAND_HEIGHT*threads_num(t);
+  fileinput_process_job_t job = { .c = c, .lut = lut, .f = f };
+  job.out = (float *)malloc(sizeof(float)*3*wd*chunk);
+  if(!job.out || resample_init(&job.rs, c->filter, fileinput_pixels(in), 3, in->width, in->height,
+        0.0f, 0.0f, in->width/(float)wd, in->height/(float)ht, wd, ht))
+  {
+    resample_cleanup(&job.rs);
+    free(job.out);
+    fclose(out);
+    return 1;
+  }
+  for(job.row=0; job.row<ht; job.row+=chunk)
+  {
+    job.num_rows = MIN(chunk, ht - job.row);
+    threads_run(t, _fileinput_process_band, &job, (job.num_rows + FILEINPUT_BAND_HEIGHT - 1)/FILEINPUT_BAND_HEIGHT);
+    fwrite(job.out, sizeof(float), 3*wd*job.num_rows, out);
   }
+  resample_cleanup(&job.rs);
+  free(job.out);
   fclose(out);
   if(c->verbosity & s_timing)
   {
@@ -221,106 +740,617 @@ static inline int fileinput_process(fileinput_t *in, const fileinput_conversion_
   return 0;
 }
 
-/* grab a framebuffer from the mmapped file, only use the memory allocated for the framebuffer.
- * this needs to be extremely efficient to allow for video playback. */
-static inline int fileinput_grab(fileinput_t *in, const fileinput_conversion_t *c, uint8_t *buf)
+/* what the output buffer currently shows, so the next grab can reuse it. besides the
+ * converted display pixels this keeps the resampled linear input at output resolution,
+ * so conversion changes like exposure don't have to touch the input file again. */
+typedef struct fileinput_view_t
 {
-  double start = _time_wallclock();
-  const uint64_t wd = in->format == s_pfm ? in->pfm.width  : in->fb.header->width;
-  const uint64_t ht = in->format == s_pfm ? in->pfm.height : in->fb.header->height;
-  const int32_t roix = CLAMP(c->roi.x, 0, MAX(0, wd - c->roi_out.w/c->roi.scale - 1));
-  const int32_t roiy = CLAMP(c->roi.y, 0, MAX(0, ht - c->roi_out.h/c->roi.scale - 1));
-  // skip dead frames
-  if(in->fd < 0) return 1;
-  const float scalex = 1.0f/c->roi.scale;
-  const float scaley = 1.0f/c->roi.scale;
-  int32_t ix2 = roix;
-  int32_t iy2 = roiy;
-  int32_t ibw = wd, ibh = ht;
-  int32_t obw = c->roi_out.w, obh = c->roi_out.h;
-  int32_t ow = c->roi_out.w, oh = c->roi_out.h;
-  int32_t ox2 = MAX(0, (c->roi_out.w-wd*c->roi.scale)*.5f);
-  int32_t oy2 = MAX(0, (c->roi_out.h-ht*c->roi.scale)*.5f);
-  int32_t oh2 = MIN(MIN(oh, MAX(0, (ibh - iy2)/scaley)), MAX(0, obh - oy2));
-  int32_t ow2 = MIN(MIN(ow, MAX(0, (ibw - ix2)/scalex)), MAX(0, obw - ox2));
-  assert((int)(ix2 + ow2*scalex) <= ibw);
-  assert((int)(iy2 + oh2*scaley) <= ibh);
-  assert(ox2 + ow2 <= obw);
-  assert(oy2 + oh2 <= obh);
-  assert(ix2 >= 0 && iy2 >= 0 && ox2 >= 0 && oy2 >= 0);
-  float x = ix2, y = iy2;
-
-  float sc = 1.0f;
-  if(in->format == s_pfm && in->pfm.scale) sc = in->pfm.scale[0];
-  if(in->format == s_fb) sc = in->fb.header->gain;
-  const float f = sc * powf(2.0f, c->exposure);
-
-  // TODO parallel
-  // fill top/bottom borders:
-  for(int j=0;j<oy2;j++) memset(buf + 3*j*obw, 0, 3*obw);
-  for(int j=oy2+oh2;j<obh;j++) memset(buf + 3*j*obw, 0, 3*obw);
-  for(int s=0; s<oh2; s++)
+  const fileinput_t *in;      // file sampled, null if nothing is cached
+  int level;                  // mip level sampled from
+  float scale;                // output pixels per pixel of the image
+  resample_filter_t filter;
+  float ix2, iy2;             // origin of the view in pixels of the mip level
+  int32_t obw, obh;           // output buffer dimensions
+  int32_t ox2, oy2, ow2, oh2; // output region covered by the image
+  float *linear;              // resampled input, three planes (r, g, b) of obw floats per output row
+  size_t linear_size;         // floats allocated for it, it only grows
+
+  int dirty;                  // the display buffer was overwritten since, only linear is still valid
+  fileinput_conversion_t c;   // conversion of the display buffer
+  float gain;                 // gain of the file at the time
+  int lut_serial;             // version of the display lut
+}
+fileinput_view_t;
+
+static inline void fileinput_view_cleanup(fileinput_view_t *v)
+{
+  free(v->linear);
+  v->linear = 0;
+  v->linear_size = 0;
+  v->in = 0;
+}
+
+/* non-zero if the display pixels of both views were converted the same way. */
+static inline int _fileinput_view_same_conversion(const fileinput_view_t *old, const fileinput_view_t *v)
+{
+  const fileinput_conversion_t *c = &v->c, *o = &old->c;
+  return !old->dirty && old->lut_serial == v->lut_serial && old->gain == v->gain &&
+    o->exposure == c->exposure && o->channels == c->channels && o->colorin == c->colorin &&
+    o->colorout == c->colorout && o->curve == c->curve && o->gamutmap == c->gamutmap;
+}
+
+/* if the new view v samples the input like the old one, up to an offset of whole output
+ * pixels, return non-zero and the offset (sx, sy) the old content moves by. */
+static inline int _fileinput_view_pan(const fileinput_view_t *old, const fileinput_view_t *v, int *sx, int *sy)
+{
+  if(!old->in || old->in != v->in || old->level != v->level || old->scale != v->scale || old->filter != v->filter) return 0;
+  if(old->obw != v->obw || old->obh != v->obh) return 0;
+  if(old->ox2 != v->ox2 || old->oy2 != v->oy2 || old->ow2 != v->ow2 || old->oh2 != v->oh2) return 0;
+  const float scale = v->scale * (1<<v->level);
+  const float dx = (old->ix2 - v->ix2)*scale, dy = (old->iy2 - v->iy2)*scale;
+  *sx = (int)rintf(dx);
+  *sy = (int)rintf(dy);
+  // drags move by whole screen pixels, up to rounding of the origin
+  if(fabsf(dx - *sx) > 1e-2f || fabsf(dy - *sy) > 1e-2f) return 0;
+  return abs(*sx) < v->obw && abs(*sy) < v->obh;
+}
+
+/* move the content of a buffer of h rows by (sx, sy) pixels. a row holds np planes
+ * of w pixels of size bytes each. */
+static inline void _fileinput_shift(void *buf, const size_t size, const int np, const int w, const int h, const int sx, const int sy)
+{
+  uint8_t *b = (uint8_t *)buf;
+  const size_t stride = size*np*w;
+  const int n = w - abs(sx);
+  for(int k=0;k<h-abs(sy);k++)
+  {
+    const int j = sy > 0 ? h-1-k : k; // destination row, in an order that keeps the source rows intact
+    for(int p=0;p<np;p++)
+      memmove(b + stride*j + size*(w*p + MAX(0, sx)), b + stride*(j-sy) + size*(w*p + MAX(0, -sx)), size*n);
+  }
+}
+
+/* polled by the thread calling grab between chunks of rows, a non-zero return
+ * abandons the frame. */
+typedef struct fileinput_cancel_t
+{
+  int (*poll)(void *data);
+  void *data;
+}
+fileinput_cancel_t;
+
+typedef struct fileinput_grab_job_t
+{
+  kernel_params_t kernel;     // pixel conversion
+  const float *in;            // input pixels, the image or one of its mip levels
+  int32_t nc, ibw, ibh;       // floats per input pixel, input dimensions
+  float ix2, iy2;             // origin of the view in input pixels
+  float scale;                // input pixels per output pixel
+  resample_filter_t filter;
+  int32_t obw, obh;           // output buffer dimensions
+  int32_t ox2, oy2, ow2, oh2; // output region covered by the image
+  float *linear;              // resampled input, see fileinput_view_t
+  uint32_t *buf;              // output buffer, display pixels
+
+  int32_t x0, y0, x1, y1;     // rectangle of the output buffer being rendered
+  int32_t cx0, cy0, cx1, cy1; // part of the rectangle covered by the image
+  int resample;               // resample the rectangle into linear first, or only convert it
+  resample_t rs;              // sampling of that part
+  int task0;                  // first band of the chunk being rendered
+  const fileinput_cancel_t *cancel;
+}
+fileinput_grab_job_t;
+
+/* convert one band of rows of the rectangle, including the black borders around the image. */
+static inline void _fileinput_grab_band(void *data, const int task)
+{
+  const fileinput_grab_job_t *job = (const fileinput_grab_job_t *)data;
+  const int32_t obw = job->obw, x0 = job->x0, x1 = job->x1;
+  const int32_t cx0 = job->cx0, cx1 = job->cx1, cy0 = job->cy0, cy1 = job->cy1;
+  const int32_t cw = cx1 - cx0;
+  uint32_t *buf = job->buf;
+  const int j0 = job->y0 + (job->task0 + task) * FILEINPUT_BAND_HEIGHT;
+  const int j1 = MIN(j0 + FILEINPUT_BAND_HEIGHT, job->y1);
+  if(job->resample && cw > 0)
+  { // rows of the image in this band, resampled and de-interleaved for the conversion kernel
+    const int r0 = CLAMP(j0 - cy0, 0, cy1 - cy0), r1 = CLAMP(j1 - cy0, 0, cy1 - cy0);
+    float *scratch = (float *)malloc(sizeof(float)*3*cw*MAX(1, r1 - r0));
+    const int fail = !scratch || resample_rows(&job->rs, r0, r1, scratch);
+    for(int r=r0;r<r1;r++) for(int k=0;k<3;k++)
+    {
+      float *lin = job->linear + 3*obw*(size_t)(cy0 + r) + obw*k + cx0;
+      if(fail) memset(lin, 0, sizeof(float)*cw); // out of memory, black
+      else memcpy(lin, scratch + 3*cw*(r - r0) + cw*k, sizeof(float)*cw);
+    }
+    free(scratch);
+  }
+  for(int j=j0; j<j1; j++)
   {
+    // fill top/bottom borders:
+    if(cw <= 0 || j < cy0 || j >= cy1)
+    {
+      memset(buf + obw*j + x0, 0, sizeof(uint32_t)*(x1 - x0));
+      continue;
+    }
     // fill left/right borders
-    for(int t=0;t<3*ox2;t++) buf[3*obw*(oy2+s)+t] = 0.0f;
-    for(int t=3*(ow2+ox2);t<3*obw;t++) buf[3*obw*(oy2+s)+t] = 0.0f;
+    memset(buf + obw*j + x0, 0, sizeof(uint32_t)*(cx0 - x0));
+    memset(buf + obw*j + cx1, 0, sizeof(uint32_t)*(x1 - cx1));
+
+    const float *row = job->linear + 3*obw*(size_t)j + cx0;
+    const float *const rgb[3] = {row, row + obw, row + 2*obw};
+    const int idx = cx0 + obw*j;
+    job->kernel.row(&job->kernel, rgb, buf + idx, cw, idx);
+  }
+}
 
-    int idx = ox2 + obw*(oy2+s);
-    for(int t=0; t<ow2; t++)
+/* render the rectangle [x0, x1) x [y0, y1) of the output buffer, resampling the
+ * input into the linear buffer first if resample is set. returns non-zero if cancelled. */
+static inline int _fileinput_grab_rect(
+    fileinput_grab_job_t *job,
+    threads_t *threads,
+    const int resample,
+    const int x0, const int y0, const int x1, const int y1)
+{
+  if(x1 <= x0 || y1 <= y0) return 0;
+  job->x0 = x0; job->y0 = y0;
+  job->x1 = x1; job->y1 = y1;
+  job->cx0 = CLAMP(job->ox2, x0, x1);
+  job->cy0 = CLAMP(job->oy2, y0, y1);
+  job->cx1 = CLAMP(job->ox2 + job->ow2, job->cx0, x1);
+  job->cy1 = CLAMP(job->oy2 + job->oh2, job->cy0, y1);
+  job->resample = resample;
+  memset(&job->rs, 0, sizeof(job->rs));
+  if(resample && resample_init(&job->rs, job->filter, job->in, job->nc, job->ibw, job->ibh,
+        job->ix2 + (job->cx0 - job->ox2)*job->scale, job->iy2 + (job->cy0 - job->oy2)*job->scale,
+        job->scale, job->scale, job->cx1 - job->cx0, job->cy1 - job->cy0))
+    job->cy1 = job->cy0; // out of memory, all black
+  // a few bands per thread at a time, to look for cancellation in between
+  const int num_tasks = (y1 - y0 + FILEINPUT_BAND_HEIGHT - 1)/FILEINPUT_BAND_HEIGHT;
+  const int chunk = job->cancel ? 2*threads_num(threads) : num_tasks;
+  int cancelled = 0;
+  for(job->task0=0; job->task0<num_tasks; job->task0+=chunk)
+  {
+    if((cancelled = job->cancel && job->cancel->poll(job->cancel->data))) break;
+    threads_run(threads, _fileinput_grab_band, job, MIN(chunk, num_tasks - job->task0));
+  }
+  resample_cleanup(&job->rs);
+  return cancelled;
+}
+
+// counts grabs, to find the least recently used mip pyramids
+static uint64_t _fileinput_mip_clock = 0;
+
+/* drop the least recently used mip pyramids of the files until they fit the budget. */
+static inline void fileinput_mip_evict(fileinput_t *in, const int num, const size_t budget)
+{
+  size_t size = 0;
+  for(int k=0;k<num;k++) size += mip_size(&in[k].mip);
+  while(size > budget)
+  {
+    int lru = -1;
+    for(int k=0;k<num;k++)
+      if(mip_size(&in[k].mip) && (lru < 0 || in[k].mip.used < in[lru].mip.used)) lru = k;
+    if(lru < 0 || in[lru].mip.used == _fileinput_mip_clock) break; // keep the one on screen
+    size -= mip_size(&in[lru].mip);
+    mip_cleanup(&in[lru].mip);
+  }
+}
+
+/* the rows [y0, y1) of the file that grabbing the output rows [j0, j1) of view c
+ * samples at full resolution, widened by the support of the filter. */
+static inline void _fileinput_roi_rows(fileinput_t *in, const fileinput_conversion_t *c, const int j0, const int j1, int64_t *y0, int64_t *y1)
+{
+  const uint64_t ht = in->height;
+  const float roiy = CLAMP(c->roi.y, 0, MAX(0, ht - c->roi_out.h/c->roi.scale - 1));
+  const int32_t oy2 = MAX(0, (c->roi_out.h-ht*c->roi.scale)*.5f);
+  const float r = resample_filter_radius[c->filter] * MAX(1.0f, 1.0f/c->roi.scale) + 2.0f;
+  *y0 = CLAMP((int64_t)floorf(roiy + MAX(0, j0 - oy2)/c->roi.scale - r), 0, (int64_t)ht);
+  *y1 = CLAMP((int64_t)ceilf(roiy + MAX(0, j1 - oy2)/c->roi.scale + r), *y0, (int64_t)ht);
+}
+
+// read size bytes at offset, with our own descriptor opened with O_DIRECT or else through the page cache
+static inline int _fileinput_reader_read(fileinput_reader_t *r, fileinput_reader_slot_t *s, fileinput_t *in, uint8_t *buf, const size_t size, const off_t offset)
+{
+  if(s->direct && s->fd < 0 && (s->fd = open(in->filename, O_RDONLY | FILEINPUT_O_DIRECT)) < 0)
+    s->direct = 0; // not all file systems can
+  if(s->direct && !uring_read(&r->ring, s->fd, buf, size, offset)) return 0;
+  s->direct = 0;
+  const int fd = fileinput_fd(in);
+  return fd < 0 || uring_read(&r->ring, fd, buf, size, offset);
+}
+
+/* the rows [y0, y1) of the pixels of in, read into a buffer of the reader, or null
+ * if reading failed. the pointer is to the first float of row y0 and stays valid
+ * until FILEINPUT_READER_SLOTS other bands were read. */
+static inline const float *_fileinput_read_rows(fileinput_t *in, const int64_t y0, const int64_t y1)
+{
+  fileinput_reader_t *r = fileinput_reader();
+  const size_t stride = sizeof(float) * in->width * in->channels;
+  // a slot that has the rows already, or one of the file to reuse its descriptor, or the oldest
+  fileinput_reader_slot_t *s = 0;
+  for(int k=0;k<FILEINPUT_READER_SLOTS;k++)
+  {
+    fileinput_reader_slot_t *t = r->slot + k;
+    if(t->in == in && t->y0 <= y0 && t->y1 >= y1)
     {
-      float tmp[3];
-      // TODO: fb channel offset selection
-      const int nc = in->format == s_pfm ? 3 : in->fb.header->channels;
-      const float *const inb = in->format == s_pfm ? in->pfm.pixel : in->fb.fb;
-      for(int k=0; k<3; k++) tmp[k] = //255.0f*in->pfm.pixel[3*(ibw*(int)y + (int)x) + k];
-      (inb[nc*(ibw*(int32_t) y +            (int32_t) (x + .5f*scalex)) + k] +
-       inb[nc*(ibw*(int32_t)(y+.5f*scaley) +(int32_t) (x + .5f*scalex)) + k] +
-       inb[nc*(ibw*(int32_t)(y+.5f*scaley) +(int32_t) (x             )) + k] +
-       inb[nc*(ibw*(int32_t) y +            (int32_t) (x             )) + k])*.25f;
+      t->used = ++r->clock;
+      return (const float *)(t->buf + t->offset + stride*(y0 - t->y0));
+    }
+  }
+  for(int k=0;k<FILEINPUT_READER_SLOTS && !s;k++) if(r->slot[k].in == in) s = r->slot + k;
+  for(int k=0;k<FILEINPUT_READER_SLOTS && !s;k++) if(!r->slot[k].in) s = r->slot + k;
+  for(int k=0;k<FILEINPUT_READER_SLOTS;k++) if(!s || r->slot[k].used < s->used) s = r->slot + k;
+  if(s->in != in)
+  {
+    _fileinput_reader_free(s);
+    s->direct = r->mode == s_reader_direct;
+  }
+  s->in = in;
+  s->used = ++r->clock;
+  s->y0 = s->y1 = 0;
 
-      // float exposure; adjust exposure
-      transform_exposure(tmp, f);
-      for(int k=0;k<3;k++) assert(tmp[k] == tmp[k]);
+  // the byte range in the file, widened to whole blocks for O_DIRECT
+  const size_t begin = in->offset + stride*y0, end = in->offset + stride*y1;
+  const size_t b = begin & ~(FILEINPUT_READER_ALIGN - 1);
+  const size_t e = (end + FILEINPUT_READER_ALIGN - 1) & ~(FILEINPUT_READER_ALIGN - 1);
+  if(s->cap < e - b)
+  {
+    free(s->buf);
+    s->cap = e - b;
+    s->buf = (uint8_t *)aligned_alloc(FILEINPUT_READER_ALIGN, s->cap);
+    if(!s->buf)
+    {
+      s->cap = 0;
+      _fileinput_reader_free(s);
+      return 0;
+    }
+  }
+  const double start = _time_wallclock();
+  const int err = _fileinput_reader_read(r, s, in, s->buf, e - b, b);
+  r->time += _time_wallclock() - start;
+  if(err)
+  {
+    _fileinput_reader_free(s);
+    return 0;
+  }
+  r->bytes += e - b;
+  s->y0 = y0;
+  s->y1 = y1;
+  s->offset = begin - b;
+  return (const float *)(s->buf + s->offset);
+}
 
-      // color conversion
-      transform_color(tmp, c->colorin, c->colorout, 1);
-      for(int k=0;k<3;k++) assert(tmp[k] == tmp[k]);
+/* where the image at mip level goes in the output buffer of view c, and the part of it
+ * that is sampled. fills the geometry of v, the buffer dimensions are set already. */
+static inline void _fileinput_view_layout(const fileinput_t *in, const fileinput_conversion_t *c, const int level, fileinput_view_t *v)
+{
+  const uint64_t wd = in->width, ht = in->height;
+  const int32_t ibw = (wd + (1<<level) - 1) >> level, ibh = (ht + (1<<level) - 1) >> level; // as mip_get
+  const float roix = CLAMP(c->roi.x, 0, MAX(0, wd - c->roi_out.w/c->roi.scale - 1));
+  const float roiy = CLAMP(c->roi.y, 0, MAX(0, ht - c->roi_out.h/c->roi.scale - 1));
+  const float scalex = 1.0f/(c->roi.scale * (1<<level));
+  const float scaley = scalex;
+  const int32_t obw = v->obw, obh = v->obh;
+  const int32_t ow = c->roi_out.w, oh = c->roi_out.h;
+  v->level = level;
+  v->ix2 = roix / (1<<level);
+  v->iy2 = roiy / (1<<level);
+  v->ox2 = MAX(0, (c->roi_out.w-wd*c->roi.scale)*.5f);
+  v->oy2 = MAX(0, (c->roi_out.h-ht*c->roi.scale)*.5f);
+  v->oh2 = MIN(MIN(oh, MAX(0, (ibh - v->iy2)/scaley)), MAX(0, obh - v->oy2));
+  v->ow2 = MIN(MIN(ow, MAX(0, (ibw - v->ix2)/scalex)), MAX(0, obw - v->ox2));
+  assert((int)(v->ix2 + v->ow2*scalex) <= ibw);
+  assert((int)(v->iy2 + v->oh2*scaley) <= ibh);
+  assert(v->ox2 + v->ow2 <= obw);
+  assert(v->oy2 + v->oh2 <= obh);
+  assert(v->ix2 >= 0 && v->iy2 >= 0 && v->ox2 >= 0 && v->oy2 >= 0);
+}
 
-      // gamut mapping 
-      if(c->colorin != s_passthrough)
-        transform_gamutmap(tmp, c->gamutmap);
-      for(int k=0;k<3;k++) assert(tmp[k] == tmp[k]);
+/* grab a framebuffer from the mmapped file, only use the memory allocated for the framebuffer.
+ * this needs to be extremely efficient to allow for video playback.
+ * view describes what buf holds and is updated, it may be null. what it caches is reused:
+ * when the new frame only pans the previous one, the previous content is moved and only the
+ * newly exposed strips are rendered, and read. when only the conversion changed, the pixels
+ * are converted again from the cached linear input without reading the file.
+ * mip levels coarser than max_level are only used if they exist already.
+ * cancel may be null. returns 0 on success, 1 for dead frames and 2 if cancelled,
+ * in which case buf is left half done. */
+static inline int _fileinput_grab(
+    fileinput_t *in,
+    const fileinput_conversion_t *c,
+    threads_t *threads,
+    lut_t *lut,
+    const fileinput_cancel_t *cancel,
+    fileinput_view_t *view,
+    const int max_level,
+    uint32_t *buf)
+{
+  double start = _time_wallclock();
+  // skip dead frames. the reader does not need the mapping
+  const int reader = fileinput_reader()->mode != s_reader_mmap;
+  if(fileinput_probe(in) || (!reader && fileinput_map(in)))
+  {
+    if(view) view->in = 0;
+    return 1;
+  }
+  const uint64_t wd = in->width, ht = in->height;
+  fileinput_view_t tmp = {0};
+  if(!view) view = &tmp;
 
-      // apply curve
-      transform_curve(tmp, buf+3*idx, c->curve, c->channels);
+  struct stat st; // the file may have been written since the mip levels were built
+  if(c->roi.scale * 2 <= 1.0f && !stat(in->filename, &st))
+    mip_validate(&in->mip, st.st_mtime, st.st_size);
+  // sample from the coarsest mip level that still has at least the output resolution
+  int level = 0;
+  while(level+1 < MIP_LEVELS && c->roi.scale * (2 << level) <= 1.0f &&
+      (level < max_level || in->mip.level[level+1].pixel)) level++;
+  int built = 0;     // the mip level can be made from a level that exists, without the file
+  for(int j=1;j<=level;j++) built |= in->mip.level[j].pixel != 0;
 
-      // zero out channels
-      if(c->curve != s_viridis)
-        transform_channels(buf+3*idx, c->channels);
+  const int32_t obw = c->roi_out.w, obh = c->roi_out.h;
+  if(view->linear_size < 3ul*obw*obh)
+  {
+    free(view->linear);
+    view->linear_size = 3ul*obw*obh;
+    view->linear = (float *)malloc(sizeof(float)*view->linear_size);
+    view->in = 0;
+    if(!view->linear)
+    {
+      view->linear_size = 0;
+      memset(buf, 0, sizeof(uint32_t)*obw*obh);
+      return 1;
+    }
+  }
+  lut_update(lut, threads, c->colorout, c->gamutmap, c->curve);
+  fileinput_view_t v = {
+    .in = in, .scale = c->roi.scale, .filter = c->filter, .obw = obw, .obh = obh,
+    .linear = view->linear, .linear_size = view->linear_size,
+    .c = *c, .gain = in->gain, .lut_serial = lut->serial,
+  };
+  _fileinput_view_layout(in, c, level, &v);
 
-      x += scalex;
-      idx++;
+  // what can be kept of the last frame decides what has to be read
+  int sx = 0, sy = 0;
+  const int sampled = _fileinput_view_pan(view, &v, &sx, &sy);
+  int pan = sampled && (sx || sy);
+  const int convert = sampled && !pan && !_fileinput_view_same_conversion(view, &v);
+
+  const float *inb = 0;
+  int32_t nc = in->channels;
+  int32_t ibw = wd, ibh = ht;
+  int64_t band = 0; // row of the image inb starts at
+  if(!convert)
+  { // converting the same view again needs no input
+    inb = in->data ? fileinput_pixels(in) : 0;
+    if(reader && !built)
+    { // read the rows under the view or the strips a pan exposes, or all of them to build the mip level
+      int64_t y0 = 0, y1 = ht;
+      if(!level) _fileinput_roi_rows(in, c,
+          pan && !sx && sy < 0 ? obh + sy : 0, pan && !sx && sy > 0 ? sy : obh, &y0, &y1);
+      const float *rows = _fileinput_read_rows(in, y0, y1);
+      if(rows)
+      {
+        inb = rows;
+        band = y0;
+      }
+    }
+    if(!inb && !built) inb = _fileinput_mapped_pixels(in); // no reader, or it failed
+    const mip_level_t *mip = level && (inb || built) ? mip_get(&in->mip, threads, inb, nc, wd, ht, level) : 0;
+    if(mip)
+    {
+      inb = mip->pixel;
+      nc = 3;
+      ibw = mip->width;
+      ibh = mip->height;
+      band = 0;
+    }
+    else if(level)
+    { // the mip level could not be allocated, sample the full resolution image instead
+      level = 0;
+      _fileinput_view_layout(in, c, level, &v);
+      pan = 0;
     }
-    y += scaley;
-    x = ix2;
+    if(!inb) inb = _fileinput_mapped_pixels(in);
+    if(!inb)
+    {
+      view->in = 0;
+      return 1;
+    }
+  }
+  in->mip.used = ++_fileinput_mip_clock;
+
+  fileinput_grab_job_t job = {
+    .in = inb, .nc = nc, .ibw = ibw, .ibh = ibh - band,
+    .ix2 = v.ix2, .iy2 = v.iy2 - band, .scale = 1.0f/(c->roi.scale * (1<<level)),
+    .filter = c->filter,
+    .obw = obw, .obh = obh,
+    .ox2 = v.ox2, .oy2 = v.oy2, .ow2 = v.ow2, .oh2 = v.oh2,
+    .linear = view->linear,
+    .buf = buf,
+    .cancel = cancel,
+  };
+  kernel_init(&job.kernel, lut, in->gain * powf(2.0f, c->exposure),
+      c->colorin, c->colorout, c->gamutmap, c->curve, c->channels, &c->format);
+
+  int cancelled = 0;
+  const char *how = "";
+  if(pan)
+  { // move what is still visible, then render the exposed strips along the top/bottom and left/right
+    // the stripes of the gamut marks are laid out by output pixel index and would not line up
+    const int keep = _fileinput_view_same_conversion(view, &v) && c->gamutmap != s_gamut_mark;
+    _fileinput_shift(view->linear, sizeof(float), 3, obw, obh, sx, sy);
+    if(keep) _fileinput_shift(buf, sizeof(uint32_t), 1, obw, obh, sx, sy);
+    const int j0 = MAX(0, sy), j1 = obh + MIN(0, sy);
+    cancelled =
+      (sy > 0 && _fileinput_grab_rect(&job, threads, 1, 0, 0, obw, sy)) ||
+      (sy < 0 && _fileinput_grab_rect(&job, threads, 1, 0, obh + sy, obw, obh)) ||
+      (sx > 0 && _fileinput_grab_rect(&job, threads, 1, 0, j0, sx, j1)) ||
+      (sx < 0 && _fileinput_grab_rect(&job, threads, 1, obw + sx, j0, obw, j1)) ||
+      (!keep  && _fileinput_grab_rect(&job, threads, 0, 0, 0, obw, obh));
+    how = " (pan)";
+  }
+  else if(convert)
+  { // same view, only convert again
+    cancelled = _fileinput_grab_rect(&job, threads, 0, 0, 0, obw, obh);
+    how = " (conversion only)";
   }
+  else cancelled = _fileinput_grab_rect(&job, threads, 1, 0, 0, obw, obh);
+  *view = v;
+  if(cancelled) view->in = 0; // the linear buffer is half done, too
+  if(view == &tmp) fileinput_view_cleanup(&tmp);
   if(c->verbosity & s_timing)
   {
     double end = _time_wallclock();
-    fprintf(stderr, "[grab] frame rendered in %.04f sec\n", end-start);
+    fprintf(stderr, "[grab] frame %s in %.04f sec%s\n", cancelled ? "cancelled" : "rendered", end-start, how);
   }
-  return 0;
+  return cancelled ? 2 : 0;
+}
+
+static inline int fileinput_grab(
+    fileinput_t *in,
+    const fileinput_conversion_t *c,
+    threads_t *threads,
+    lut_t *lut,
+    const fileinput_cancel_t *cancel,
+    fileinput_view_t *view,
+    uint32_t *buf)
+{
+  return _fileinput_grab(in, c, threads, lut, cancel, view, MIP_LEVELS-1, buf);
+}
+
+/* render a preview at 1/f of the resolution with a box filter and blow it up to fill buf.
+ * the preview samples from the mip level the full frame would use, or coarser ones that
+ * exist already, so it never reads more of the file than the full frame. view caches the
+ * preview like it does for fileinput_grab, it can't be shared with full frames. */
+static inline int fileinput_grab_preview(
+    fileinput_t *in,
+    const fileinput_conversion_t *c,
+    threads_t *threads,
+    lut_t *lut,
+    const fileinput_cancel_t *cancel,
+    fileinput_view_t *view,
+    const int f,
+    uint32_t *buf)
+{
+  int level = 0;
+  while(level+1 < MIP_LEVELS && c->roi.scale * (2 << level) <= 1.0f) level++;
+  fileinput_conversion_t p = *c;
+  p.roi.scale = c->roi.scale / f;
+  p.roi_out.w = (c->roi_out.w + f - 1) / f;
+  p.roi_out.h = (c->roi_out.h + f - 1) / f;
+  p.filter = s_filter_box;
+  p.verbosity = s_silent;
+  const int sw = p.roi_out.w, w = c->roi_out.w, h = c->roi_out.h;
+  uint32_t *small = (uint32_t *)malloc(sizeof(uint32_t)*sw*p.roi_out.h);
+  const int err = small ? _fileinput_grab(in, &p, threads, lut, cancel, view, level, small) : 1;
+  if(!err) for(int j=0;j<h;j++)
+  {
+    const uint32_t *row = small + sw*(j/f);
+    uint32_t *out = buf + w*j;
+    for(int i=0;i<w;i++) out[i] = row[i/f];
+  }
+  free(small);
+  return err;
 }
 
 /* prefetches the input buffer by instructing the kernel that we'll soon need it. */
 static inline void fileinput_prefetch(fileinput_t *in)
 {
-  madvise(in->data, in->data_size, MADV_WILLNEED);
+  size_t size;
+  void *data = _fileinput_mapping(in, &size);
+  if(size) madvise(data, size, MADV_WILLNEED);
+}
+
+// the access pattern of the whole mapping, only given again when it changes
+static inline void _fileinput_advise(fileinput_t *in, const int advice)
+{
+  if(in->advice == advice) return;
+  size_t size;
+  void *data = _fileinput_mapping(in, &size);
+  if(size) madvise(data, size, advice);
+  in->advice = advice;
 }
 
-/* instructs the kernel that we're done for now. */
+// rows at least this many pages long are read in parts when only a narrow part is visible
+#define FILEINPUT_NARROW_PAGES 4
+
+/* tell the kernel how grabbing view c will read the file, and start reading what it
+ * samples in the background. views zoomed out far enough for a mip level read all
+ * rows front to back to build it, unless the level was built already and the file
+ * is not read at all. views at full resolution read a band of rows, and if only a
+ * narrow part of long rows is visible, readahead around the pages we touch would
+ * mostly read pixels we don't show: readahead is turned off and only the visible
+ * part of each row is asked for. */
+static inline void fileinput_prefetch_roi(fileinput_t *in, const fileinput_conversion_t *c)
+{
+  if(fileinput_map(in)) return; // dead frame
+  const uint64_t wd = in->width, ht = in->height;
+  const uint8_t *inb = (const uint8_t *)fileinput_pixels(in);
+  const size_t px = sizeof(float) * in->channels, stride = px * wd;
+  const uintptr_t page = sysconf(_SC_PAGESIZE);
+  int64_t y0 = 0, y1 = ht;
+  if(c->roi.scale * 2 <= 1.0f)
+  {
+    if(in->mip.level[1].pixel) return;
+    _fileinput_advise(in, MADV_SEQUENTIAL);
+  }
+  else
+  {
+    _fileinput_roi_rows(in, c, 0, c->roi_out.h, &y0, &y1);
+    const float roix = CLAMP(c->roi.x, 0, MAX(0, wd - c->roi_out.w/c->roi.scale - 1));
+    const float r = resample_filter_radius[c->filter] * MAX(1.0f, 1.0f/c->roi.scale) + 2.0f;
+    const int64_t x0 = CLAMP((int64_t)floorf(roix - r), 0, (int64_t)wd);
+    const int64_t x1 = CLAMP((int64_t)ceilf(roix + c->roi_out.w/c->roi.scale + r), x0, (int64_t)wd);
+    const int narrow = 2*px*(x1 - x0) < stride && stride >= FILEINPUT_NARROW_PAGES*page;
+    _fileinput_advise(in, narrow ? MADV_RANDOM : MADV_NORMAL);
+    if(narrow)
+    { // the visible part of each row, parts on the same pages asked for at once
+      uintptr_t b = 0, e = 0;
+      for(int64_t j=y0;j<y1;j++)
+      {
+        const uintptr_t rb = ((uintptr_t)inb + stride*j + px*x0) & ~(page - 1);
+        if(rb > e)
+        {
+          if(e > b) madvise((void *)b, e - b, MADV_WILLNEED);
+          b = rb;
+        }
+        e = (uintptr_t)inb + stride*j + px*x1;
+      }
+      if(e > b) madvise((void *)b, e - b, MADV_WILLNEED);
+      return;
+    }
+  }
+  const uintptr_t b = ((uintptr_t)inb + stride*y0) & ~(page - 1);
+  const uintptr_t e = (uintptr_t)inb + stride*y1;
+  if(e > b) madvise((void *)b, e - b, MADV_WILLNEED);
+}
+
+/* instructs the kernel that we're done for now: our mapping lets go of the pages, and
+ * while we have a descriptor, the page cache drops them unless somebody else maps them. */
 static inline void fileinput_dontneed(fileinput_t *in)
 {
-  madvise(in->data, in->data_size, MADV_DONTNEED);
+  size_t size;
+  void *data = _fileinput_mapping(in, &size);
+  if(size) madvise(data, size, MADV_DONTNEED);
+  // under the lock, so the pool can't close the descriptor meanwhile. if it was closed
+  // to make room, don't open another one behind the back of the pool
+  fileinput_pool_t *p = &_fileinput_pool;
+  pthread_mutex_lock(&p->mutex);
+  if(in->fd >= 0) posix_fadvise(in->fd, 0, 0, POSIX_FADV_DONTNEED);
+  pthread_mutex_unlock(&p->mutex);
+}
+
+/* bytes of the file that are in memory now. */
+static inline size_t fileinput_resident(fileinput_t *in)
+{
+  size_t size;
+  void *data = _fileinput_mapping(in, &size);
+  const size_t page = sysconf(_SC_PAGESIZE), pages = (size + page - 1)/page;
+  unsigned char *vec = size ? (unsigned char *)malloc(pages) : 0;
+  size_t cnt = 0;
+  if(vec && !mincore(data, size, vec))
+    for(size_t i=0;i<pages;i++) cnt += vec[i] & 1;
+  free(vec);
+  return cnt * page;
 }
 
@@ -37,10 +37,21 @@ typedef struct framebuffer_t
 }
 framebuffer_t;
 
-// map a framebuffer read only
-static inline int fb_map(
+// check that a file of data_size bytes with this header is a framebuffer
+static inline int fb_header_check(
+    const framebuffer_header_t *h,
+    const uint64_t data_size)
+{
+  if(h->magic != FRAMEBUFFER_MAGIC) return 1;
+  if(h->width*h->height*h->channels*sizeof(float) + sizeof(framebuffer_header_t) != data_size) return 2;
+  return 0;
+}
+
+// map a framebuffer read only, with extra mmap flags such as MAP_POPULATE
+static inline int fb_map_flags(
     framebuffer_t *fb,
-    const char *filename)
+    const char *filename,
+    const int flags)
 {
   memset(fb, 0, sizeof(*fb));
   strncpy(fb->filename, filename, sizeof(fb->filename));
@@ -51,11 +62,10 @@ static inline int fb_map(
 
   if(data_size < sizeof(framebuffer_header_t)) goto fail;
 
-  fb->header = mmap(0, data_size, PROT_READ, MAP_SHARED | MAP_NORESERVE, fd, 0);
+  fb->header = mmap(0, data_size, PROT_READ, MAP_SHARED | MAP_NORESERVE | flags, fd, 0);
   fb->fb = (float *)((uint8_t *)fb->header + sizeof(framebuffer_header_t));
 
-  if(fb->header->magic != FRAMEBUFFER_MAGIC) goto fail;
-  if(fb->header->width*fb->header->height*fb->header->channels*sizeof(float) + sizeof(framebuffer_header_t) != data_size) goto fail;
+  if(fb_header_check(fb->header, data_size)) goto fail;
   close(fd);
 
   fb->retain = 1; // by default, don't delete if we only mapped it, not created it
@@ -66,6 +76,14 @@ fail:
   return 2;
 }
 
+// map a framebuffer read only
+static inline int fb_map(
+    framebuffer_t *fb,
+    const char *filename)
+{
+  return fb_map_flags(fb, filename, 0);
+}
+
 // initialise a new framebuffer with file backing
 // note that this one will unlink the file once done with it by default.
 // change the behaviour by setting fb->retain = 1.
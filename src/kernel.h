@@ -0,0 +1,139 @@
+#pragma once
+#include "transform.h"
+#include "lut.h"
+#include "cpu.h"
+
+#include <stdint.h>
+#include <string.h>
+
+/* conversion of rows of linear input pixels to 32-bit display pixels.
+ * the input row comes in structure-of-arrays layout (reds, greens and blues in
+ * separate arrays), which is processed in blocks of pixels using the compiler's
+ * generic vector extensions. the kernels are compiled once per instruction set
+ * tier in kernel_isa.h, with one sse, avx2 or avx-512 register per channel, and
+ * kernel_init picks the tier of the running cpu (see cpu.h).
+ *
+ * every combination of tone curve, gamut mapping and transfer function has its
+ * own pre-instantiated row kernel in kernel_table, so there are no per-pixel
+ * branches on the configuration. exposure, file gain and the input to output
+ * color matrix are folded into one 3x3 matrix once per frame by kernel_init.
+ * the tone response of the custom display profile comes from a baked 3d lut,
+ * the other transfer functions and the tone curves from 1d luts. */
+
+// transfer functions applied after the color matrix
+typedef enum kernel_transfer_t
+{
+  s_transfer_linear = 0,   // passthrough and rec709
+  s_transfer_srgb,         // srgb gamma with linear toe slope
+  s_transfer_adobergb,     // adobe rgb gamma
+  s_transfer_lut3d,        // custom profile: tone response and gamut map baked into a 3d lut
+  s_transfer_cnt,
+}
+kernel_transfer_t;
+
+// gamut mapping as 1 + transform_gamut_t, or none for passthrough input
+#define KERNEL_GAMUT_NONE 0
+#define KERNEL_GAMUT_CNT 4
+#define KERNEL_CURVE_CNT 6
+
+/* pixel layout of the display: every pixel is a 32-bit word holding red, green
+ * and blue at the given bit offsets, with bits per channel (8, or 10 on deep
+ * colour visuals). */
+typedef struct kernel_format_t
+{
+  int shift[3];
+  int bits;
+}
+kernel_format_t;
+
+// xrgb, the layout of 24-bit visuals
+static const kernel_format_t kernel_format_xrgb8 = { .shift = {16, 8, 0}, .bits = 8 };
+
+struct kernel_params_t;
+typedef void (*kernel_row_t)(
+    const struct kernel_params_t *p,
+    const float *const rgb[3],
+    uint32_t *out,
+    const int n,
+    const int idx);
+
+/* everything the kernel needs to know about the conversion, set up by kernel_init. */
+typedef struct kernel_params_t
+{
+  float M[9];          // gain, exposure and input to output color matrix, row major
+  const lut_t *lut;    // display profile lut and the 1d luts of transfer function and curve
+  int channel[3];      // source of each output channel, for channel selection
+  int viridis;         // input channel of the viridis colour map
+  float max;           // largest value of a channel in the display format
+  int shift[3];        // bit offset of the output channels in a pixel
+  kernel_row_t row;    // specialised row kernel for this configuration
+}
+kernel_params_t;
+
+
+#define KERNEL_FOR_CURVES(X, T, G) X(T, G, 0) X(T, G, 1) X(T, G, 2) X(T, G, 3) X(T, G, 4) X(T, G, 5)
+#define KERNEL_FOR_GAMUTS(X, T) \
+  KERNEL_FOR_CURVES(X, T, 0) KERNEL_FOR_CURVES(X, T, 1) KERNEL_FOR_CURVES(X, T, 2) KERNEL_FOR_CURVES(X, T, 3)
+#define KERNEL_FOR_ALL(X) \
+  KERNEL_FOR_GAMUTS(X, 0) KERNEL_FOR_GAMUTS(X, 1) KERNEL_FOR_GAMUTS(X, 2) KERNEL_FOR_GAMUTS(X, 3)
+
+#define KERNEL_ISA sse2
+#define KERNEL_WIDTH 4
+#define KERNEL_TARGET
+#include "kernel_isa.h"
+#if CPU_X86
+#define KERNEL_ISA avx2
+#define KERNEL_WIDTH 8
+#define KERNEL_TARGET CPU_TARGET_AVX2
+#include "kernel_isa.h"
+#define KERNEL_ISA avx512
+#define KERNEL_WIDTH 16
+#define KERNEL_TARGET CPU_TARGET_AVX512
+#include "kernel_isa.h"
+static const kernel_row_t *const kernel_table[] = {kernel_table_sse2, kernel_table_avx2, kernel_table_avx512};
+#else
+static const kernel_row_t *const kernel_table[] = {kernel_table_sse2, kernel_table_sse2, kernel_table_sse2};
+#endif
+
+/* fold the conversion into the kernel parameters and pick the row kernel.
+ * f is the combined file gain and exposure, lut needs to be up to date (see lut_update)
+ * for this transfer function and curve. */
+static inline void kernel_init(
+    kernel_params_t *p,
+    const lut_t *lut,
+    const float f,
+    const transform_color_t colorin,
+    const transform_color_t colorout,
+    const transform_gamut_t gamutmap,
+    const transform_curve_t curve,
+    const transform_channels_t channels,
+    const kernel_format_t *format)
+{
+  static const float identity[] = {1, 0, 0, 0, 1, 0, 0, 0, 1};
+  const float *M = identity;
+  kernel_transfer_t transfer = s_transfer_linear;
+  int gamut = KERNEL_GAMUT_NONE;
+  if(colorin != s_passthrough)
+  {
+    gamut = 1 + gamutmap;
+    if(colorout == s_custom)
+    { // the lut bakes all gamut mappings but the position dependent mark
+      M = lut->profile.xyz_to_rgb;
+      transfer = s_transfer_lut3d;
+      if(gamutmap != s_gamut_mark) gamut = KERNEL_GAMUT_NONE;
+    }
+    else
+    {
+      M = transform_color_matrix(colorout);
+      if(colorout == s_srgb) transfer = s_transfer_srgb;
+      if(colorout == s_adobergb) transfer = s_transfer_adobergb;
+    }
+  }
+  for(int k=0;k<9;k++) p->M[k] = f * M[k];
+  p->lut = lut;
+  for(int k=0;k<3;k++) p->channel[k] = (curve != s_viridis && channels < 3) ? channels : k;
+  p->viridis = channels % 3;
+  p->max = (1 << format->bits) - 1;
+  for(int k=0;k<3;k++) p->shift[k] = format->shift[k];
+  p->row = kernel_table[cpu_isa()][(transfer*KERNEL_GAMUT_CNT + gamut)*KERNEL_CURVE_CNT + curve];
+}
@@ -0,0 +1,186 @@
+/* one instruction set tier of the row kernels, included once per tier by kernel.h.
+ * expects KERNEL_ISA (name suffix), KERNEL_WIDTH (pixels per block) and
+ * KERNEL_TARGET (function attribute selecting the instruction set) to be defined,
+ * and defines KERNEL_ISA_NAME(table) with all configurations of this tier.
+ * no include guard on purpose. */
+
+#define KERNEL_ISA_PASTE2(A, B) A##_##B
+#define KERNEL_ISA_PASTE(A, B) KERNEL_ISA_PASTE2(A, B)
+#define KERNEL_ISA_NAME(N) KERNEL_ISA_PASTE(kernel_##N, KERNEL_ISA)
+
+// everything in here is specific to this tier and must be inlined into its row kernels
+#define KERNEL_INLINE static inline __attribute__((always_inline)) KERNEL_TARGET
+#define kernel_vf     KERNEL_ISA_NAME(vf)
+#define kernel_vi     KERNEL_ISA_NAME(vi)
+#define kernel_load   KERNEL_ISA_NAME(load)
+#define kernel_set1   KERNEL_ISA_NAME(set1)
+#define kernel_blend  KERNEL_ISA_NAME(blend)
+#define kernel_lut1d  KERNEL_ISA_NAME(lut1d)
+#define kernel_block  KERNEL_ISA_NAME(block)
+#define kernel_row    KERNEL_ISA_NAME(row)
+
+typedef float   kernel_vf __attribute__((vector_size(4*KERNEL_WIDTH)));
+typedef int32_t kernel_vi __attribute__((vector_size(4*KERNEL_WIDTH)));
+
+KERNEL_INLINE kernel_vf kernel_load(const float *p)
+{
+  kernel_vf v;
+  memcpy(&v, p, sizeof(v)); // no alignment requirements
+  return v;
+}
+
+KERNEL_INLINE kernel_vf kernel_set1(const float f)
+{
+  return (kernel_vf){0} + f;
+}
+
+// per lane m ? a : b, for a comparison result m
+KERNEL_INLINE kernel_vf kernel_blend(const kernel_vi m, const kernel_vf a, const kernel_vf b)
+{
+  return (kernel_vf)((m & (kernel_vi)a) | (~m & (kernel_vi)b));
+}
+
+// per lane lookup in a baked 1d lut
+KERNEL_INLINE kernel_vf kernel_lut1d(const lut1d_t *l, const kernel_vf x)
+{
+  kernel_vf r;
+  for(int k=0;k<KERNEL_WIDTH;k++) r[k] = lut1d_apply(l, x[k]);
+  return r;
+}
+
+/* convert one block of KERNEL_WIDTH pixels v[3] into display pixels at out.
+ * T, G, C are the transfer, gamut and curve indices, compile time constants in every instance. */
+KERNEL_INLINE void kernel_block(
+    const kernel_params_t *p,
+    const kernel_vf v[3],
+    uint32_t *out,
+    const int idx,
+    const int T, const int G, const int C)
+{
+  const float *M = p->M;
+  kernel_vf w[3];
+  for(int k=0;k<3;k++)
+    w[k] = v[0]*M[3*k] + v[1]*M[3*k+1] + v[2]*M[3*k+2];
+
+  if(T == s_transfer_srgb)
+  {
+    const transform_srgb_t srgb = transform_srgb_params();
+    const lut1d_t *l = p->lut->lut1d + s_lut1d_srgb;
+    for(int k=0;k<3;k++)
+    { // the toe is cheap, only look up the rest
+      const kernel_vi toe = w[k] < srgb.linear;
+      w[k] = kernel_blend(toe, srgb.c * w[k], kernel_lut1d(l, kernel_blend(toe, kernel_set1(srgb.linear), w[k])));
+    }
+  }
+  else if(T == s_transfer_adobergb)
+  {
+    const lut1d_t *l = p->lut->lut1d + s_lut1d_adobergb;
+    for(int k=0;k<3;k++)
+    {
+      const kernel_vi sign = (kernel_vi)w[k] & (int32_t)0x80000000u;
+      const kernel_vf mag = (kernel_vf)((kernel_vi)w[k] & 0x7fffffff);
+      w[k] = (kernel_vf)((kernel_vi)kernel_lut1d(l, mag) | sign);
+    }
+  }
+  else if(T == s_transfer_lut3d)
+  {
+    for(int l=0;l<KERNEL_WIDTH;l++)
+    {
+      const float lin[3] = {w[0][l], w[1][l], w[2][l]};
+      float rgb[3];
+      lut3d_apply(p->lut, lin, rgb);
+      for(int k=0;k<3;k++) w[k][l] = rgb[k];
+    }
+  }
+
+  if(G == 1 + s_gamut_clamp)
+  { // nans become zero too
+    for(int k=0;k<3;k++) w[k] = kernel_blend(w[k] > 0.0f, w[k], kernel_set1(0.0f));
+  }
+  else if(G != KERNEL_GAMUT_NONE)
+  {
+    for(int l=0;l<KERNEL_WIDTH;l++)
+    {
+      float tmp[3] = {w[0][l], w[1][l], w[2][l]};
+      transform_gamutmap(tmp, G - 1, idx + l);
+      for(int k=0;k<3;k++) w[k][l] = tmp[k];
+    }
+  }
+
+  if(C != s_none)
+  {
+    for(int l=0;l<KERNEL_WIDTH;l++)
+    {
+      float tmp[3] = {w[0][l], w[1][l], w[2][l]}, res[3];
+      lut_curve_eval(p->lut, tmp, res, C, p->viridis);
+      for(int k=0;k<3;k++) w[k][l] = res[k];
+    }
+  }
+
+  // channel selection, clamp to the display depth and pack into its pixel layout
+  kernel_vi q = {0};
+  for(int k=0;k<3;k++)
+  {
+    kernel_vf s = p->max * w[p->channel[k]];
+    s = kernel_blend(s > 0.0f, s, kernel_set1(0.0f));
+    s = kernel_blend(s < p->max, s, kernel_set1(p->max));
+    q |= __builtin_convertvector(s, kernel_vi) << p->shift[k];
+  }
+  memcpy(out, &q, sizeof(q));
+}
+
+/* convert n pixels of the soa row rgb[0..2] to display pixels in out.
+ * idx is the output pixel index of the first pixel. the tail of the row
+ * goes through the same code on a zero padded block. */
+KERNEL_INLINE void kernel_row(
+    const kernel_params_t *p,
+    const float *const rgb[3],
+    uint32_t *out,
+    const int n,
+    const int idx,
+    const int T, const int G, const int C)
+{
+  int i = 0;
+  for(; i+KERNEL_WIDTH<=n; i+=KERNEL_WIDTH)
+  {
+    const kernel_vf v[3] = {kernel_load(rgb[0]+i), kernel_load(rgb[1]+i), kernel_load(rgb[2]+i)};
+    kernel_block(p, v, out+i, idx+i, T, G, C);
+  }
+  if(i < n)
+  {
+    kernel_vf v[3] = {{0}};
+    uint32_t tail[KERNEL_WIDTH];
+    for(int l=0;l<n-i;l++)
+      for(int k=0;k<3;k++) v[k][l] = rgb[k][i+l];
+    kernel_block(p, v, tail, idx+i, T, G, C);
+    memcpy(out+i, tail, sizeof(uint32_t)*(n-i));
+  }
+}
+
+// instantiate all configurations T, G, C of this tier
+#define KERNEL_DEFINE(T, G, C) \
+static KERNEL_TARGET void KERNEL_ISA_NAME(row_##T##_##G##_##C)(const kernel_params_t *p, const float *const rgb[3], uint32_t *out, const int n, const int idx) \
+{ kernel_row(p, rgb, out, n, idx, T, G, C); }
+KERNEL_FOR_ALL(KERNEL_DEFINE)
+#undef KERNEL_DEFINE
+
+#define KERNEL_ENTRY(T, G, C) KERNEL_ISA_NAME(row_##T##_##G##_##C),
+// indexed by (T*KERNEL_GAMUT_CNT + G)*KERNEL_CURVE_CNT + C
+static const kernel_row_t KERNEL_ISA_NAME(table)[] = { KERNEL_FOR_ALL(KERNEL_ENTRY) };
+#undef KERNEL_ENTRY
+
+#undef kernel_vf
+#undef kernel_vi
+#undef kernel_load
+#undef kernel_set1
+#undef kernel_blend
+#undef kernel_lut1d
+#undef kernel_block
+#undef kernel_row
+#undef KERNEL_INLINE
+#undef KERNEL_ISA_NAME
+#undef KERNEL_ISA_PASTE
+#undef KERNEL_ISA_PASTE2
+#undef KERNEL_TARGET
+#undef KERNEL_WIDTH
+#undef KERNEL_ISA
@@ -0,0 +1,297 @@
+#pragma once
+#include "profile.h"
+#include "threads.h"
+
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* look up tables baked from the display profile, the transfer functions and the
+ * tone curves. they are rebuilt only when the profile file or the gamut mapping
+ * changes, never per frame. the 1d tables don't depend on anything and are baked
+ * the first time they are needed. */
+
+// nodes per axis of the 3d lut, odd to put one node on zero
+#define LUT3D_SIZE 41
+// largest magnitude covered by the 3d lut, larger input is evaluated directly
+#define LUT3D_MAX 16.0f
+
+// entries of each 1d lut
+#define LUT1D_SIZE 4096
+
+// the 1d curves, all of them are transcendental or otherwise expensive to evaluate
+typedef enum lut1d_curve_t
+{
+  s_lut1d_srgb = 0,      // srgb encode above the linear toe
+  s_lut1d_adobergb,      // adobe rgb gamma on magnitudes
+  s_lut1d_contrast,      // s shaped part of the contrast curve
+  s_lut1d_tonemap,       // luma compression of the tonemap curve
+  s_lut1d_viridis_r,     // viridis colour map, one table per output channel
+  s_lut1d_viridis_g,
+  s_lut1d_viridis_b,
+  s_lut1d_canon,         // darktable base curve
+  s_lut1d_cnt,
+}
+lut1d_curve_t;
+
+// input range [0, max] covered by each table, beyond it the curve is evaluated directly
+static const float lut1d_max[] = { 16.0f, 16.0f, 1.0f, 64.0f, 1.0f, 1.0f, 1.0f, 4.0f };
+
+typedef struct lut1d_t
+{
+  lut1d_curve_t curve;  // what is in the table
+  float max;            // largest input covered by the table
+  float *table;         // LUT1D_SIZE samples, square root spaced on [0, max]
+}
+lut1d_t;
+
+typedef struct lut_t
+{
+  profile_t profile;    // display profile used for s_custom output
+  time_t mtime;         // modification time of the profile file when it was read
+  float *lut3d;         // linear to display rgb, LUT3D_SIZE^3 nodes of rgb, red fastest
+  int lut3d_gamut;      // gamut mapping baked into lut3d, -1 if invalid
+  int serial;           // counts bakes of lut3d, so cached output can tell it changed
+  lut1d_t lut1d[s_lut1d_cnt]; // transfer functions and tone curves, table is null until baked
+}
+lut_t;
+
+// exact evaluation of the 1d curves
+static inline float lut1d_eval(const lut1d_curve_t c, const float x)
+{
+  switch(c)
+  {
+    case s_lut1d_srgb:
+    {
+      const transform_srgb_t p = transform_srgb_params();
+      return powf(p.a*x + p.b, p.g);
+    }
+    case s_lut1d_adobergb: return powf(x, TRANSFORM_ADOBERGB_GAMMA);
+    case s_lut1d_contrast: return transform_contrast(x);
+    case s_lut1d_tonemap:  return transform_tonemap_luma(x);
+    case s_lut1d_canon:    return canon_curve(x);
+    default:
+    {
+      float rgb[3];
+      transform_viridis(x, rgb);
+      return rgb[c - s_lut1d_viridis_r];
+    }
+  }
+}
+
+/* linear interpolation in the table. the square root shaper puts more samples
+ * close to zero, where the gamma curves are steepest. */
+static inline float lut1d_lookup(const lut1d_t *l, const float x)
+{
+  const float u = sqrtf(x/l->max) * (LUT1D_SIZE - 1);
+  const int i = MIN(LUT1D_SIZE - 2, (int)u);
+  const float f = u - i;
+  return (1.0f-f)*l->table[i] + f*l->table[i+1];
+}
+
+/* curve value at x, from the table if x is in range. nans go to the exact curve, too. */
+static inline float lut1d_apply(const lut1d_t *l, const float x)
+{
+  if(x >= 0.0f && x <= l->max) return lut1d_lookup(l, x);
+  return lut1d_eval(l->curve, x);
+}
+
+static inline void lut1d_bake(lut1d_t *l, const lut1d_curve_t c)
+{
+  if(l->table) return; // never changes
+  l->curve = c;
+  l->max = lut1d_max[c];
+  l->table = (float *)malloc(sizeof(float)*LUT1D_SIZE);
+  for(int i=0;i<LUT1D_SIZE;i++)
+  {
+    const float s = i/(LUT1D_SIZE - 1.0f);
+    l->table[i] = lut1d_eval(c, l->max * s*s);
+  }
+}
+
+/* tone curve c on linear rgb tmp using the baked tables, see transform_curve_eval. */
+static inline void lut_curve_eval(const lut_t *l, const float *tmp, float *res, const transform_curve_t c, int cc)
+{
+  if(c == s_contrast)
+  {
+    const lut1d_t *t = l->lut1d + s_lut1d_contrast;
+    for(int k=0;k<3;k++)
+      res[k] = (1.0f-TRANSFORM_CONTRAST)*tmp[k] + TRANSFORM_CONTRAST*lut1d_apply(t, CLAMP(tmp[k], 0.0f, 1.0f));
+  }
+  else if(c == s_tonemap)
+  {
+    float yuv[3];
+    transform_rgb_to_yuv(tmp, yuv);
+    transform_tonemap(yuv, lut1d_apply(l->lut1d + s_lut1d_tonemap, yuv[0]), res);
+  }
+  else if(c == s_viridis)
+  {
+    const float x = CLAMP(tmp[cc % 3], 0.0f, 1.0f);
+    for(int k=0;k<3;k++) res[k] = lut1d_apply(l->lut1d + s_lut1d_viridis_r + k, x);
+  }
+  else if(c == s_canon)
+  {
+    for(int k=0;k<3;k++) res[k] = lut1d_apply(l->lut1d + s_lut1d_canon, tmp[k]);
+  }
+  else transform_curve_eval(tmp, res, c, cc);
+}
+
+/* position on the 3d lut grid axis for input x. the lut covers [-LUT3D_MAX, LUT3D_MAX],
+ * negative values are needed for gamut mapping. the fourth root shaper puts most
+ * nodes close to zero, where display tone curves are steepest. */
+static inline float lut3d_shaper(const float x)
+{
+  const float s = sqrtf(sqrtf(CLAMP(fabsf(x) * (1.0f/LUT3D_MAX), 0.0f, 1.0f)));
+  return (copysignf(s, x) + 1.0f) * (.5f*(LUT3D_SIZE - 1));
+}
+
+static inline float lut3d_shaper_inv(const float u)
+{
+  const float s = 2.0f*u/(LUT3D_SIZE - 1) - 1.0f;
+  return copysignf(LUT3D_MAX * s*s*s*s, s);
+}
+
+/* tetrahedral interpolation of the 3d lut at linear display rgb lin. */
+static inline void lut3d_lookup(const float *lut, const float *lin, float *rgb)
+{
+  const int N = LUT3D_SIZE;
+  float f[3];
+  int i[3];
+  for(int k=0;k<3;k++)
+  {
+    const float u = lut3d_shaper(lin[k]);
+    i[k] = MIN(N - 2, (int)u);
+    f[k] = u - i[k];
+  }
+  const int sx = 3, sy = 3*N, sz = 3*N*N;
+  const float *c000 = lut + sx*i[0] + sy*i[1] + sz*i[2];
+  const float *c111 = c000 + sx + sy + sz;
+  const float *a, *b; // the two inner corners of the tetrahedron
+  float fa, fb, fc;   // sorted weights, largest first
+  const float fx = f[0], fy = f[1], fz = f[2];
+  if(fx > fy)
+  {
+    if(fy > fz)      { a = c000 + sx;      b = c000 + sx + sy; fa = fx; fb = fy; fc = fz; }
+    else if(fx > fz) { a = c000 + sx;      b = c000 + sx + sz; fa = fx; fb = fz; fc = fy; }
+    else             { a = c000 + sz;      b = c000 + sx + sz; fa = fz; fb = fx; fc = fy; }
+  }
+  else
+  {
+    if(fz > fy)      { a = c000 + sz;      b = c000 + sy + sz; fa = fz; fb = fy; fc = fx; }
+    else if(fz > fx) { a = c000 + sy;      b = c000 + sy + sz; fa = fy; fb = fz; fc = fx; }
+    else             { a = c000 + sy;      b = c000 + sx + sy; fa = fy; fb = fx; fc = fz; }
+  }
+  for(int k=0;k<3;k++)
+    rgb[k] = (1.0f-fa)*c000[k] + (fa-fb)*a[k] + (fb-fc)*b[k] + fc*c111[k];
+}
+
+// exact evaluation of what the 3d lut holds
+static inline void _lut3d_eval(const profile_t *p, const int gamut, const float *lin, float *rgb)
+{
+  if(p->function)
+  { // lin is xyz here. the old functions take powers of negative values, keep nans out of the lut
+    colorout_xyz_to_rgb(lin, rgb);
+    for(int k=0;k<3;k++) if(!(rgb[k] == rgb[k])) rgb[k] = 0.0f;
+  }
+  else for(int k=0;k<3;k++)
+    rgb[k] = profile_trc_encode(p->trc+k, lin[k]);
+  // the mark pattern depends on the pixel position and can't be baked
+  if(gamut != s_gamut_mark)
+    transform_gamutmap(rgb, gamut, 0);
+}
+
+/* look up linear display rgb lin in the baked lut, or evaluate it exactly
+ * for the rare bright pixels beyond its range. */
+static inline void lut3d_apply(const lut_t *l, const float *lin, float *rgb)
+{
+  if(fabsf(lin[0]) < LUT3D_MAX && fabsf(lin[1]) < LUT3D_MAX && fabsf(lin[2]) < LUT3D_MAX)
+    lut3d_lookup(l->lut3d, lin, rgb);
+  else
+    _lut3d_eval(&l->profile, l->lut3d_gamut, lin, rgb);
+}
+
+typedef struct _lut3d_job_t
+{
+  lut_t *lut;
+  int gamut;
+}
+_lut3d_job_t;
+
+static inline void _lut3d_bake_slice(void *data, const int z)
+{
+  const _lut3d_job_t *job = (const _lut3d_job_t *)data;
+  const profile_t *p = &job->lut->profile;
+  const int N = LUT3D_SIZE;
+  for(int y=0;y<N;y++) for(int x=0;x<N;x++)
+  {
+    const float lin[3] = {lut3d_shaper_inv(x), lut3d_shaper_inv(y), lut3d_shaper_inv(z)};
+    _lut3d_eval(p, job->gamut, lin, job->lut->lut3d + 3*(x + N*(y + N*z)));
+  }
+}
+
+/* bake tone response and gamut mapping of the display profile into the 3d lut.
+ * the profile matrix is applied before the lookup, folded with the exposure. */
+static inline void lut3d_bake(lut_t *l, threads_t *t, const transform_gamut_t gamut)
+{
+  const int N = LUT3D_SIZE;
+  if(!l->lut3d) l->lut3d = (float *)malloc(sizeof(float)*3*N*N*N);
+  _lut3d_job_t job = { .lut = l, .gamut = gamut };
+  threads_run(t, _lut3d_bake_slice, &job, N);
+  l->lut3d_gamut = gamut;
+  l->serial++;
+}
+
+/* set the display profile file. null or a file we can't read selects the built-in profile. */
+static inline void lut_init(lut_t *l, const char *filename)
+{
+  memset(l, 0, sizeof(*l));
+  l->lut3d_gamut = -1;
+  struct stat st;
+  if(filename && !stat(filename, &st) && !profile_load(&l->profile, filename))
+    l->mtime = st.st_mtime;
+  else
+    profile_init_custom(&l->profile);
+}
+
+static inline void lut_cleanup(lut_t *l)
+{
+  profile_cleanup(&l->profile);
+  free(l->lut3d);
+  l->lut3d = 0;
+  for(int k=0;k<s_lut1d_cnt;k++)
+  {
+    free(l->lut1d[k].table);
+    l->lut1d[k].table = 0;
+  }
+}
+
+/* reload the profile if the file changed and rebake what is outdated. cheap if nothing changed. */
+static inline void lut_update(
+    lut_t *l,
+    threads_t *t,
+    const transform_color_t colorout,
+    const transform_gamut_t gamut,
+    const transform_curve_t curve)
+{
+  if(colorout == s_srgb)     lut1d_bake(l->lut1d + s_lut1d_srgb, s_lut1d_srgb);
+  if(colorout == s_adobergb) lut1d_bake(l->lut1d + s_lut1d_adobergb, s_lut1d_adobergb);
+  if(curve == s_contrast)    lut1d_bake(l->lut1d + s_lut1d_contrast, s_lut1d_contrast);
+  if(curve == s_tonemap)     lut1d_bake(l->lut1d + s_lut1d_tonemap, s_lut1d_tonemap);
+  if(curve == s_canon)       lut1d_bake(l->lut1d + s_lut1d_canon, s_lut1d_canon);
+  if(curve == s_viridis)
+    for(int k=s_lut1d_viridis_r;k<=s_lut1d_viridis_b;k++) lut1d_bake(l->lut1d + k, k);
+
+  if(colorout != s_custom) return;
+  struct stat st;
+  if(l->profile.filename[0] && !stat(l->profile.filename, &st) && st.st_mtime != l->mtime)
+  {
+    char filename[1024];
+    memcpy(filename, l->profile.filename, sizeof(filename));
+    profile_load(&l->profile, filename);
+    memcpy(l->profile.filename, filename, sizeof(filename)); // keep watching the file on failure
+    l->mtime = st.st_mtime;
+    l->lut3d_gamut = -1;
+  }
+  if(l->lut3d_gamut != gamut) lut3d_bake(l, t, gamut);
+}
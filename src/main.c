@@ -33,13 +33,62 @@ static inline char* load_sidecar(fileinput_t *file)
 
 static inline void show_title()
 {
-    char title[256];
-    snprintf(title, 256, "%sframe %04d/%04d -- %s",
+    char title[256], cached[64] = "";
+    if(eu.fill && eu.shown)
+      snprintf(cached, 64, " [%04d-%04d, %d cached]", eu.begin+1, eu.end+1, eu.shown->cached);
+    snprintf(title, 256, "%sframe %04d/%04d%s -- %s",
              eu.file[eu.current_file].flag ? "*" : " ",
-             eu.current_file+1, eu.num_files, eu.file[eu.current_file].filename);
+             eu.current_file+1, eu.num_files, cached, eu.file[eu.current_file].filename);
     display_title(eu.display, title);
 }
 
+// bar of the play range, how much of it is in the ram cache, and how playback keeps up
+static inline void show_cache(const render_frame_t *f)
+{
+  char msg[512];
+  int len = snprintf(msg, sizeof(msg), "playing %04d ", f->file+1);
+  // u2581..u2588, from an eighth to a full block
+  for(int i=0;i<f->num_cells;i++)
+    len += snprintf(msg + len, sizeof(msg) - len, "\xe2\x96%c", 0x81 + f->cell[i]);
+  const play_t *p = &eu.play;
+  display_print(eu.display, 0, 0, "%s\n%.1f of %g fps %s, %lu dropped, %.0f MB resident", msg,
+      p->rate, p->fps, play_mode_name[p->mode], (unsigned long)p->dropped, f->resident/1e6);
+}
+
+/* the frames likely to be wanted after the current one: the next ones of the play
+ * clock while playing, or further in the direction of the last step. */
+static inline int frames_ahead(int *ahead)
+{
+  int n = 0;
+  if(eu.gui.play)
+  {
+    for(int i=1;i<=eu.window && i<=eu.play.end-eu.play.begin;i++)
+    {
+      const int k = play_frame(&eu.play, eu.play.tick + i);
+      if(k != eu.current_file && (!n || ahead[n-1] != k)) ahead[n++] = k;
+    }
+    return n;
+  }
+  for(int k=eu.current_file+eu.step;k>=0 && k<eu.num_files && n<eu.window;k+=eu.step)
+    if(!eu.step_flagged || eu.file[k].flag) ahead[n++] = k;
+  return n;
+}
+
+/* hand the current state to the render thread. */
+static inline void request_frame()
+{
+  render_request_t req = {
+    .conv = eu.conv,
+    .file = eu.current_file,
+    .play = eu.gui.play,
+    .begin = eu.begin,
+    .end = eu.end,
+    .fill = eu.fill,
+  };
+  req.num_ahead = frames_ahead(req.ahead);
+  render_post(&eu.render, &req);
+}
+
 static inline void show_metadata()
 {
   if(eu.gui.show_metadata)
@@ -103,11 +152,12 @@ int onKeyDown(keycode_t key)
       eu.gui.input_string[eu.gui.input_string_len++] = '-';
 
     display_print(eu.display, 0, 0, "exposure %s", eu.gui.input_string);
-    return 1; // redraw string
+    return 0; // only the message changed
   }
   else switch(key)
   {
     case KeyOne: // toggle 1:1 and 1:2
+      eu.fit = 0;
       if(eu.conv.roi.scale == 1.0f)
         eu.conv.roi.scale = 2.0f;
       else 
@@ -115,11 +165,15 @@ int onKeyDown(keycode_t key)
       offset_image(x, y);
       return 1;
     case KeyTwo: // scale to fit
+      eu.fit = fileinput_pending(eu.file+eu.current_file, FILEINPUT_PROBE_WAIT) ? key : 0;
+      if(!fileinput_width(eu.file+eu.current_file)) return 0; // dead frame, or later when the size is known
       eu.conv.roi.scale = fminf(eu.display->width/(float)fileinput_width(eu.file+eu.current_file),
           eu.display->height/(float)fileinput_height(eu.file+eu.current_file));
       eu.conv.roi.x = eu.conv.roi.y = 0;
       return 1;
     case KeyThree: // scale to fill
+      eu.fit = fileinput_pending(eu.file+eu.current_file, FILEINPUT_PROBE_WAIT) ? key : 0;
+      if(!fileinput_width(eu.file+eu.current_file)) return 0;
       eu.conv.roi.scale = fmaxf(eu.display->width/(float)fileinput_width(eu.file+eu.current_file),
           eu.display->height/(float)fileinput_height(eu.file+eu.current_file));
       eu.conv.roi.x = eu.conv.roi.y = 0;
@@ -171,7 +225,14 @@ int onKeyDown(keycode_t key)
         if(f)
         {
           fprintf(f, "P6\n%d %d\n255\n", eu.display->width, eu.display->height);
-          size_t w = fwrite(eu.pixels, 3*sizeof(uint8_t), eu.display->width*eu.display->height, f);
+          size_t w = 0;
+          // the top 8 bits of the channels of the display pixels
+          for(int i=0;eu.shown && i<eu.display->width*eu.display->height;i++)
+          {
+            uint8_t rgb[3];
+            for(int k=0;k<3;k++) rgb[k] = eu.shown->pixels[i] >> (eu.display->shift[k] + eu.display->bits - 8);
+            w += fwrite(rgb, 3*sizeof(uint8_t), 1, f);
+          }
           fclose(f);
           if(w != eu.display->width*eu.display->height)
             display_print(eu.display, 0, 0, "failed to write dump.ppm");
@@ -182,6 +243,8 @@ int onKeyDown(keycode_t key)
 
     case KeyDown:
     case KeyRight:
+      eu.step = 1;
+      eu.step_flagged = shift;
       do
       {
         if(eu.current_file >= eu.num_files-1) break;
@@ -193,6 +256,8 @@ int onKeyDown(keycode_t key)
       return 1;
     case KeyLeft:
     case KeyUp:
+      eu.step = -1;
+      eu.step_flagged = shift;
       do
       {
         if(eu.current_file == 0) break;
@@ -205,7 +270,41 @@ int onKeyDown(keycode_t key)
 
     case KeySpace: // toggle play mode
       eu.gui.play ^= 1;
-      display_print(eu.display, 0, 0, eu.gui.play ? "playing all frames" : "stopped");
+      if(eu.gui.play)
+      {
+        eu.fill = 1;
+        play_start(&eu.play, eu.current_file, eu.begin, eu.end, _time_wallclock());
+        eu.current_file = play_frame(&eu.play, 0);
+        onKeyDown(KeyTwo); // scale to fit
+      }
+      display_print(eu.display, 0, 0, eu.gui.play ? "playing" : "stopped");
+      return 1;
+    case KeyMinus: // slower
+    case KeyEquals: // faster
+      play_set_fps(&eu.play, play_fps_step(eu.play.fps, key == KeyEquals ? 1 : -1), _time_wallclock());
+      display_print(eu.display, 0, 0, "play at %g fps", eu.play.fps);
+      return 0;
+    case KeyL: // loop or ping-pong
+      play_set_mode(&eu.play, (eu.play.mode + 1) % s_play_mode_cnt, _time_wallclock());
+      display_print(eu.display, 0, 0, "play %s", play_mode_name[eu.play.mode]);
+      return 0;
+
+    case KeyOpenBracket: // in point
+      eu.begin = eu.current_file;
+      eu.end = MAX(eu.end, eu.current_file);
+      eu.fill = 1;
+      display_print(eu.display, 0, 0, "play frames %04d-%04d", eu.begin+1, eu.end+1);
+      return 1;
+    case KeyCloseBracket: // out point
+      eu.end = eu.current_file;
+      eu.begin = MIN(eu.begin, eu.current_file);
+      eu.fill = 1;
+      display_print(eu.display, 0, 0, "play frames %04d-%04d", eu.begin+1, eu.end+1);
+      return 1;
+    case KeyBackSlash: // play all frames again
+      eu.begin = 0;
+      eu.end = eu.num_files-1;
+      display_print(eu.display, 0, 0, "play all frames");
       return 1;
 
     case KeyE:
@@ -213,7 +312,7 @@ int onKeyDown(keycode_t key)
       eu.gui.input_string_len = 0;
       eu.gui.input_string[0] = 0;
       display_print(eu.display, 0, 0, "exposure ..");
-      return 1;
+      return 0;
 
     case KeyH:
       if(eu.display->msg_len > 0)
@@ -231,18 +330,24 @@ int onKeyDown(keycode_t key)
                       "[s]idecar metadata\n"
                       "[t]onecurve\n"
                       "[m] gamut map\n"
+                      "[k] resampling filter\n"
                       "[i]nput color space xyz/passthrough\n"
                       "[p]rofile color space\n"
                       "[space] play\n"
+                      "[-=] play slower/faster\n"
+                      "[l]oop/ping-pong\n"
+                      "[ ] set in/out point\n"
+                      "[\\] reset in/out points\n"
                       "[d]ump PPM (dump.ppm)\n"
-                      "[x] display mouse coords\n"
+                      "[x] display mouse coords and frame stats\n"
+                      "[F11] fullscreen\n"
                       "[h]elp\n"
                       "[esc/q]uit");
-      return 1;
+      return 0;
 
     case KeyS:
       toggle_metadata();
-      return 1;
+      return 0;
 
     case KeyT:
       if(eu.conv.curve == s_none)
@@ -269,6 +374,12 @@ int onKeyDown(keycode_t key)
         display_print(eu.display, 0, 0, "curve: viridis");
         return 1;
       }
+      else if(eu.conv.curve == s_viridis)
+      {
+        eu.conv.curve = s_canon;
+        display_print(eu.display, 0, 0, "curve: base curve");
+        return 1;
+      }
       else
       {
         eu.conv.curve = s_none;
@@ -316,18 +427,39 @@ int onKeyDown(keycode_t key)
         display_print(eu.display, 0, 0, "color profile: adobergb");
       }
       return 1;
+    case KeyK: // resampling filter
+      eu.conv.filter = (eu.conv.filter + 1) % s_filter_cnt;
+      display_print(eu.display, 0, 0, "resampling filter: %s", resample_filter_name[eu.conv.filter]);
+      return 1;
+
     case KeyQ:
       return -1;
 
+    case KeyF11:
+      display_fullscreen(eu.display, !eu.display->fullscreen);
+      return 0;
+
     case KeyX: // flag/unflag for comparison
       eu.gui.show_mouse_coords ^= 1;
-      return 1;
+      return 0;
 
     default:
       return 0;
   }
 }
 
+int onResize(int w, int h)
+{
+  // the render thread fills the display buffers, stop it while they are reallocated
+  render_stop(&eu.render);
+  if(display_resize(eu.display, w, h)) return -1;
+  eu.shown = 0;
+  eu.conv.roi_out.w = w;
+  eu.conv.roi_out.h = h;
+  if(render_resize(&eu.render, w, h, eu.display->buffer)) return -1;
+  return 1;
+}
+
 int onMouseButtonDown(mouse_t *mouse)
 {
   eu.gui.pointer = eu.gui.pointer_button = *mouse;
@@ -386,8 +518,11 @@ int onMouseMove(mouse_t *mouse)
   {
       float x, y;
       pointer_to_image(&x, &y);
-      display_print(eu.display, 0, 0, "mouse %f %f", x, y);
-      return 1;
+      display_t *d = eu.display;
+      display_print(d, 0, 0, "mouse %f %f\n%.1f ms per frame, %lu of %lu events folded\n%.0f MB of the files resident", x, y,
+          1e3*d->frame_time, (unsigned long)d->num_dropped, (unsigned long)d->num_events,
+          eu.shown ? eu.shown->resident/1e6 : 0.0);
+      return 0; // the overlay is updated on its own
   }
   return 0;
 }
@@ -413,35 +548,60 @@ int main(int argc, char *arg[])
   eu.display->onMouseMove = onMouseMove;
   eu.display->onMouseButtonDown = onMouseButtonDown;
   eu.display->onMouseButtonUp = onMouseButtonUp;
+  eu.display->onResize = onResize;
 
   onKeyDown(KeyTwo); // scale to fit on startup
 
   int ret = 1;
   while(1)
   {
-    if(ret)
-    {
-      // update buffer from out-of-core storage
-      fileinput_grab(eu.file+eu.current_file, &eu.conv, eu.pixels);
-      // show on screen
-      display_update(eu.display, eu.pixels);
+    // ask the render thread for the new state, a newer request replaces older ones
+    if(ret) request_frame();
+    // wait for user input, a finished frame or the next frame of play mode.
+    // frames are shown at most once per refresh, until then newer ones replace them
+    const double pace = display_pace(eu.display), now = _time_wallclock();
+    double timeout = eu.gui.play ? MAX(0.0, play_next(&eu.play) - now) : -1.0;
+    if(pace > 0.0) timeout = timeout < 0.0 ? pace : MIN(timeout, pace);
+    display_poll(eu.display, pace > 0.0 ? -1 : render_fd(&eu.render), timeout);
+    const render_frame_t *f = 0;
+    if(display_pace(eu.display) <= 0.0)
+    { // the frame on screen goes back to the render thread, it must not be read any more
+      display_wait(eu.display);
+      f = render_take(&eu.render);
+    }
+    if(f)
+    { // show on screen
+      eu.shown = f;
+      if(eu.gui.play)
+      {
+        play_shown(&eu.play, f->file, _time_wallclock());
+        show_cache(f);
+      }
+      display_update(eu.display, f->pixels);
       show_title();
     }
-    // get user input, wait for it if need be.
-    
+    ret = display_pump_events(eu.display);
+    if(ret < 0) break;
+    // messages that changed without a new frame
+    if(!ret) display_update_overlay(eu.display);
+    if(eu.fit && !fileinput_pending(eu.file+eu.current_file, 0.0))
+      ret |= onKeyDown(eu.fit); // the render thread has read the header meanwhile
     if(eu.gui.play)
-    {
-      ret = display_pump_events(eu.display);
-      if(ret < 0) break;
-      if(eu.current_file >= eu.num_files-1) eu.current_file = 0;
-      else eu.current_file++;
-      ret = 1; // trigger redraw
-      onKeyDown(KeyTwo); // scale to fit
+    { // the clock says which frame is due, the ones we were too slow for are skipped
+      if(eu.begin != eu.play.begin || eu.end != eu.play.end || eu.current_file != play_frame(&eu.play, eu.play.tick))
+        play_start(&eu.play, eu.current_file, eu.begin, eu.end, _time_wallclock()); // new range, or the user jumped
+      const int k = play_advance(&eu.play, _time_wallclock());
+      if(k != eu.current_file)
+      {
+        // the header may not be read yet, then the frame is fit once it is
+        const int refit = fileinput_pending(eu.file+k, 0.0) ||
+          fileinput_width(eu.file+k) != fileinput_width(eu.file+eu.current_file) ||
+          fileinput_height(eu.file+k) != fileinput_height(eu.file+eu.current_file);
+        eu.current_file = k;
+        if(refit) onKeyDown(KeyTwo); // scale to fit
+        ret = 1; // trigger redraw
+      }
     }
-    else
-      ret = display_wait_event(eu.display);
-
-    if(ret < 0) break;
   }
 
 exit:
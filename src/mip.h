@@ -0,0 +1,123 @@
+#pragma once
+#include "transform.h"
+#include "threads.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* mip pyramid of an input image, for zoomed out views. level k is box filtered
+ * in linear light down by 2^k in both directions, with 3 floats per pixel. the
+ * levels are built lazily, each from the finest level that exists already (or
+ * the image itself), so only the first zoomed out view reads the whole file.
+ * the levels remember modification time and size of the file they were built
+ * from, and are dropped when the file is written again. */
+
+#define MIP_LEVELS 16
+
+typedef struct mip_level_t
+{
+  int width, height;   // ceil of the image size over 2^k
+  float *pixel;        // rgb, null while not built
+}
+mip_level_t;
+
+typedef struct mip_t
+{
+  mip_level_t level[MIP_LEVELS]; // level 0 is the image itself and never allocated
+  uint64_t used;                 // when the pyramid was last used, for eviction
+  time_t mtime;                  // of the file the levels were built from
+  size_t size;                   // same
+}
+mip_t;
+
+typedef struct _mip_job_t
+{
+  const float *src;    // finer level or image
+  int nc;              // floats per source pixel
+  int sw, sh;          // source dimensions
+  int f;               // box size in source pixels
+  mip_level_t *dst;
+}
+_mip_job_t;
+
+static inline void _mip_build_row(void *data, const int j)
+{
+  const _mip_job_t *job = (const _mip_job_t *)data;
+  const int f = job->f, nc = job->nc, sw = job->sw;
+  const int y0 = j*f, y1 = MIN(y0 + f, job->sh);
+  float *out = job->dst->pixel + 3*job->dst->width*j;
+  for(int i=0;i<job->dst->width;i++)
+  {
+    const int x0 = i*f, x1 = MIN(x0 + f, sw);
+    float sum[3] = {0.0f};
+    for(int y=y0;y<y1;y++)
+    {
+      const float *row = job->src + nc*(size_t)sw*y;
+      for(int x=x0;x<x1;x++)
+        for(int k=0;k<3;k++) sum[k] += row[nc*x + k];
+    }
+    const float norm = 1.0f/((y1 - y0)*(x1 - x0));
+    for(int k=0;k<3;k++) out[3*i+k] = sum[k]*norm;
+  }
+}
+
+/* return mip level k > 0 of the image pixel (nc floats per pixel, w x h),
+ * building it if needed. returns null if it can't be allocated. */
+static inline const mip_level_t *mip_get(
+    mip_t *m,
+    threads_t *t,
+    const float *pixel,
+    const int nc,
+    const int w,
+    const int h,
+    const int k)
+{
+  mip_level_t *l = m->level + k;
+  if(l->pixel) return l;
+  l->width  = (w + (1<<k) - 1) >> k;
+  l->height = (h + (1<<k) - 1) >> k;
+  l->pixel = (float *)malloc(sizeof(float)*3*l->width*l->height);
+  if(!l->pixel) return 0;
+
+  // start from the finest level we have
+  _mip_job_t job = { .src = pixel, .nc = nc, .sw = w, .sh = h, .f = 1<<k, .dst = l };
+  for(int j=k-1;j>0;j--) if(m->level[j].pixel)
+  {
+    job.src = m->level[j].pixel;
+    job.nc = 3;
+    job.sw = m->level[j].width;
+    job.sh = m->level[j].height;
+    job.f = 1<<(k-j);
+    break;
+  }
+  threads_run(t, _mip_build_row, &job, l->height);
+  return l;
+}
+
+/* memory held by the pyramid. */
+static inline size_t mip_size(const mip_t *m)
+{
+  size_t size = 0;
+  for(int k=1;k<MIP_LEVELS;k++)
+    if(m->level[k].pixel) size += sizeof(float)*3*m->level[k].width*m->level[k].height;
+  return size;
+}
+
+static inline void mip_cleanup(mip_t *m)
+{
+  for(int k=1;k<MIP_LEVELS;k++)
+  {
+    free(m->level[k].pixel);
+    m->level[k].pixel = 0;
+  }
+}
+
+/* drop the levels if the file is not the one they were built from any more. */
+static inline void mip_validate(mip_t *m, const time_t mtime, const size_t size)
+{
+  if(m->mtime != mtime || m->size != size) mip_cleanup(m);
+  m->mtime = mtime;
+  m->size = size;
+}
@@ -0,0 +1,154 @@
+#pragma once
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+/* playback clock: which frame of the play range is due when. the frames follow
+ * from the time since playback started, not from the frames shown so far, so
+ * slow frames don't slow down playback. frames that came due while an earlier
+ * one was still being rendered are skipped and counted as dropped. */
+
+typedef enum play_mode_t
+{
+  s_play_loop = 0,     // begin to end, then from the start again
+  s_play_pingpong,     // begin to end and back
+  s_play_mode_cnt,
+}
+play_mode_t;
+
+static const char *play_mode_name[] = {"loop", "ping-pong"};
+
+// common frame rates, stepped through with the keys
+static const double play_fps_steps[] = {1, 2, 5, 10, 12, 15, 23.976, 24, 25, 29.97, 30, 48, 50, 59.94, 60, 120};
+#define PLAY_FPS_STEPS (sizeof(play_fps_steps)/sizeof(play_fps_steps[0]))
+
+typedef struct play_t
+{
+  double fps;          // target frame rate
+  play_mode_t mode;
+  int begin, end;      // play range, inclusive
+  double start;        // when tick 0 was due
+  int first;           // position in the cycle at tick 0
+  int64_t tick;        // last tick that came due
+  int64_t shown_tick;  // tick of the last frame shown, -1 before the first
+
+  // statistics
+  uint64_t shown;      // frames shown
+  uint64_t dropped;    // frames skipped
+  double rate;         // achieved frames per second, over the last second
+  double window;       // start of the current second
+  int window_frames;   // and the frames shown in it
+}
+play_t;
+
+static inline void play_init(play_t *p, const double fps)
+{
+  memset(p, 0, sizeof(*p));
+  p->fps = fps;
+  p->mode = s_play_loop;
+}
+
+// length of one cycle of the mode, in frames
+static inline int _play_period(const play_t *p)
+{
+  const int n = p->end - p->begin + 1;
+  return p->mode == s_play_pingpong && n > 1 ? 2*n - 2 : n;
+}
+
+/* the frame shown at tick t, which is negative for ticks before the last rebase. */
+static inline int play_frame(const play_t *p, const int64_t t)
+{
+  const int n = p->end - p->begin + 1, period = _play_period(p);
+  const int q = (int)(((p->first + t) % period + period) % period);
+  return p->begin + (q < n ? q : period - q);
+}
+
+/* start playing the range [begin, end] at frame current, or at begin if that is
+ * outside. the statistics start over. */
+static inline void play_start(play_t *p, const int current, const int begin, const int end, const double now)
+{
+  p->begin = begin;
+  p->end = end > begin ? end : begin;
+  p->first = current >= p->begin && current <= p->end ? current - p->begin : 0;
+  p->start = now;
+  p->tick = 0;
+  p->shown_tick = -1; // the frame of tick 0 is yet to be shown
+  p->shown = p->dropped = 0;
+  p->rate = 0.0;
+  p->window = now;
+  p->window_frames = 0;
+}
+
+// make the last tick tick 0, so the rate or mode can change without a jump
+static inline void _play_rebase(play_t *p, const double now)
+{
+  const int frame = play_frame(p, p->tick);
+  const int back = p->mode == s_play_pingpong && p->tick > 0 && play_frame(p, p->tick - 1) > frame;
+  p->first = back ? _play_period(p) - (frame - p->begin) : frame - p->begin;
+  p->shown_tick -= p->tick;
+  p->tick = 0;
+  p->start = now;
+}
+
+static inline void play_set_fps(play_t *p, const double fps, const double now)
+{
+  _play_rebase(p, now);
+  p->fps = fps;
+}
+
+static inline void play_set_mode(play_t *p, const play_mode_t mode, const double now)
+{
+  _play_rebase(p, now);
+  p->mode = mode;
+  p->first %= _play_period(p);
+}
+
+/* the next step of the frame rate up (dir > 0) or down from fps. */
+static inline double play_fps_step(const double fps, const int dir)
+{
+  if(dir > 0)
+  {
+    for(int i=0;i<(int)PLAY_FPS_STEPS;i++) if(play_fps_steps[i] > fps + 1e-3) return play_fps_steps[i];
+    return play_fps_steps[PLAY_FPS_STEPS-1];
+  }
+  for(int i=PLAY_FPS_STEPS-1;i>=0;i--) if(play_fps_steps[i] < fps - 1e-3) return play_fps_steps[i];
+  return play_fps_steps[0];
+}
+
+/* when the next frame is due. */
+static inline double play_next(const play_t *p)
+{
+  return p->start + (p->tick + 1)/p->fps;
+}
+
+/* advance the clock to now and return the frame that is due. ticks that passed
+ * without us looking are skipped. */
+static inline int play_advance(play_t *p, const double now)
+{
+  // a little early, so waking up at play_next is always in time for the next tick
+  const int64_t t = (int64_t)floor((now - p->start)*p->fps + 1e-6);
+  if(t > p->tick) p->tick = t;
+  return play_frame(p, p->tick);
+}
+
+/* frame k is on screen now. the frames due between the last one shown and its
+ * tick were dropped. */
+static inline void play_shown(play_t *p, const int k, const double now)
+{
+  int64_t t = p->tick;
+  const int64_t oldest = p->tick - 4*_play_period(p);
+  const int64_t stop = p->shown_tick > oldest ? p->shown_tick : oldest;
+  while(t > stop && play_frame(p, t) != k) t--;
+  if(t <= stop) return; // shown before, or not from the play range
+  p->dropped += t - p->shown_tick - 1;
+  p->shown_tick = t;
+  p->shown++;
+  p->window_frames++;
+  if(now - p->window >= 1.0)
+  {
+    p->rate = p->window_frames / (now - p->window);
+    p->window = now;
+    p->window_frames = 0;
+  }
+}
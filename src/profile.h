@@ -0,0 +1,306 @@
+#pragma once
+#include "transform.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* display profile loaded at runtime: xyz to display rgb matrix (bradford adapted to
+ * the display white) and per channel tone response curves.
+ * reads matrix/trc icc profiles or a text file with the 9 numbers of the xyz to rgb
+ * matrix (row major) followed by the 3 gammas of red, green and blue, as in the
+ * color/ headers. without a file, the compiled in custom profile is used. headers
+ * written before the matrix and gammas were exported only provide
+ * colorout_xyz_to_rgb(), that function is then evaluated as a whole on xyz. */
+
+typedef enum profile_trc_type_t
+{
+  s_trc_gamma = 0,   // y = x^g
+  s_trc_para  = 1,   // icc parametric curve type 0..4
+  s_trc_table = 2,   // sampled curve on [0,1]
+}
+profile_trc_type_t;
+
+typedef struct profile_trc_t
+{
+  profile_trc_type_t type;
+  int func;          // parametric function type
+  float param[7];    // g a b c d e f, param[0] is the gamma for s_trc_gamma
+  int num;           // number of table entries
+  float *table;      // table of linear values for equidistant inputs on [0,1]
+}
+profile_trc_t;
+
+typedef struct profile_t
+{
+  float xyz_to_rgb[9];    // row major
+  profile_trc_t trc[3];   // device to linear tone response for red, green, blue
+  char filename[1024];    // source of the profile, empty for the compiled in one
+  int function;           // identity matrix, encode with colorout_xyz_to_rgb() instead of the trcs
+}
+profile_t;
+
+static inline uint32_t _profile_be32(const uint8_t *p)
+{
+  return ((uint32_t)p[0]<<24) | ((uint32_t)p[1]<<16) | ((uint32_t)p[2]<<8) | p[3];
+}
+
+static inline float _profile_s15f16(const uint8_t *p)
+{
+  return (int32_t)_profile_be32(p) / 65536.0f;
+}
+
+static inline int _profile_invert(const float *m, float *inv)
+{
+  const float det =
+      m[0]*(m[4]*m[8] - m[5]*m[7])
+    - m[1]*(m[3]*m[8] - m[5]*m[6])
+    + m[2]*(m[3]*m[7] - m[4]*m[6]);
+  if(fabsf(det) < 1e-12f) return 1;
+  const float d = 1.0f/det;
+  inv[0] =  (m[4]*m[8] - m[5]*m[7])*d;
+  inv[1] = -(m[1]*m[8] - m[2]*m[7])*d;
+  inv[2] =  (m[1]*m[5] - m[2]*m[4])*d;
+  inv[3] = -(m[3]*m[8] - m[5]*m[6])*d;
+  inv[4] =  (m[0]*m[8] - m[2]*m[6])*d;
+  inv[5] = -(m[0]*m[5] - m[2]*m[3])*d;
+  inv[6] =  (m[3]*m[7] - m[4]*m[6])*d;
+  inv[7] = -(m[0]*m[7] - m[1]*m[6])*d;
+  inv[8] =  (m[0]*m[4] - m[1]*m[3])*d;
+  return 0;
+}
+
+static inline void _profile_mul(const float *a, const float *b, float *res)
+{
+  for(int i=0;i<3;i++) for(int j=0;j<3;j++)
+  {
+    res[3*i+j] = 0.0f;
+    for(int k=0;k<3;k++) res[3*i+j] += a[3*i+k]*b[3*k+j];
+  }
+}
+
+static inline void profile_cleanup(profile_t *p)
+{
+  for(int k=0;k<3;k++)
+  {
+    free(p->trc[k].table);
+    p->trc[k].table = 0;
+  }
+}
+
+/* use the profile compiled in from color/$(COLOR).h */
+static inline void profile_init_custom(profile_t *p)
+{
+  profile_cleanup(p);
+#ifdef COLOROUT_CUSTOM_PROFILE
+  memcpy(p->xyz_to_rgb, colorout_custom_xyz_to_rgb, sizeof(p->xyz_to_rgb));
+  for(int k=0;k<3;k++)
+  {
+    p->trc[k].type = s_trc_gamma;
+    p->trc[k].param[0] = colorout_custom_gamma[k];
+  }
+  p->function = 0;
+#else
+  memset(p->xyz_to_rgb, 0, sizeof(p->xyz_to_rgb));
+  for(int k=0;k<3;k++)
+  {
+    p->xyz_to_rgb[4*k] = 1.0f;
+    p->trc[k].type = s_trc_gamma;
+    p->trc[k].param[0] = 1.0f;
+  }
+  p->function = 1;
+#endif
+  p->filename[0] = 0;
+}
+
+/* device value to linear, for x in [0,1]. */
+static inline float profile_trc_eval(const profile_trc_t *t, const float x)
+{
+  if(t->type == s_trc_gamma) return powf(x, t->param[0]);
+  if(t->type == s_trc_table)
+  {
+    const float f = CLAMP(x, 0.0f, 1.0f) * (t->num - 1);
+    const int i = MIN(t->num - 2, (int)f);
+    const float w = f - i;
+    return (1.0f-w)*t->table[i] + w*t->table[i+1];
+  }
+  const float *p = t->param; // g a b c d e f
+  switch(t->func)
+  {
+    case 0: return powf(x, p[0]);
+    case 1: return x >= -p[2]/p[1] ? powf(p[1]*x + p[2], p[0]) : 0.0f;
+    case 2: return x >= -p[2]/p[1] ? powf(p[1]*x + p[2], p[0]) + p[3] : p[3];
+    case 3: return x >= p[4] ? powf(p[1]*x + p[2], p[0]) : p[3]*x;
+    default: return x >= p[4] ? powf(p[1]*x + p[2], p[0]) + p[5] : p[3]*x + p[6];
+  }
+}
+
+/* linear to device value, the inverse of the tone response. negative input is
+ * mirrored, values beyond the range of the curve continue with a 2.2 gamma. */
+static inline float profile_trc_encode(const profile_trc_t *t, const float y)
+{
+  if(!(y == y)) return 0.0f;
+  if(y < 0.0f) return -profile_trc_encode(t, -y);
+  if(t->type == s_trc_gamma) return powf(y, 1.0f/t->param[0]);
+  const float y1 = profile_trc_eval(t, 1.0f);
+  if(y >= y1) return powf(y/y1, 1.0f/2.2f);
+  float lo = 0.0f, hi = 1.0f; // assume monotonic response
+  for(int it=0;it<24;it++)
+  {
+    const float m = .5f*(lo + hi);
+    if(profile_trc_eval(t, m) < y) lo = m;
+    else hi = m;
+  }
+  return .5f*(lo + hi);
+}
+
+static inline int _profile_read_trc(profile_trc_t *t, const uint8_t *d, const uint32_t size)
+{
+  if(size < 12) return 1;
+  if(!memcmp(d, "curv", 4))
+  {
+    const uint32_t cnt = _profile_be32(d+8);
+    if(cnt > (size - 12)/2) return 1;
+    if(cnt == 1 && !d[12] && !d[13]) return 1; // zero gamma can't be inverted
+    free(t->table); // the tag may appear more than once
+    t->table = 0;
+    t->type = s_trc_gamma;
+    if(cnt == 0) t->param[0] = 1.0f;
+    else if(cnt == 1) t->param[0] = ((d[12]<<8) | d[13]) / 256.0f;
+    else
+    {
+      t->type = s_trc_table;
+      t->num = cnt;
+      t->table = (float *)malloc(sizeof(float)*cnt);
+      for(uint32_t i=0;i<cnt;i++) t->table[i] = ((d[12+2*i]<<8) | d[13+2*i]) / 65535.0f;
+    }
+    return 0;
+  }
+  if(!memcmp(d, "para", 4))
+  {
+    static const int num_params[] = {1, 3, 4, 5, 7};
+    const int func = (d[8]<<8) | d[9];
+    if(func > 4 || size < 12 + 4*num_params[func]) return 1;
+    free(t->table);
+    t->table = 0;
+    t->type = s_trc_para;
+    t->func = func;
+    for(int i=0;i<num_params[func];i++) t->param[i] = _profile_s15f16(d+12+4*i);
+    return 0;
+  }
+  return 1;
+}
+
+static inline int _profile_read_xyz(float *xyz, const uint8_t *d, const uint32_t size)
+{
+  if(size < 20 || memcmp(d, "XYZ ", 4)) return 1;
+  for(int k=0;k<3;k++) xyz[k] = _profile_s15f16(d + 8 + 4*k);
+  return 0;
+}
+
+static inline int _profile_load_icc(profile_t *p, const uint8_t *d, const size_t size)
+{
+  if(size < 132) return 1;
+  const uint32_t num_tags = _profile_be32(d+128);
+  if(132 + 12*(size_t)num_tags > size) return 1;
+  float wtpt[3] = {0.96422f, 1.0f, 0.82521f}, prim[3][3];
+  int found = 0;
+  for(uint32_t i=0;i<num_tags;i++)
+  {
+    const uint8_t *tag = d + 132 + 12*i;
+    const uint32_t off = _profile_be32(tag+4), len = _profile_be32(tag+8);
+    if(off > size || len > size - off) return 1;
+    static const char *prims[] = {"rXYZ", "gXYZ", "bXYZ"};
+    static const char *trcs[] = {"rTRC", "gTRC", "bTRC"};
+    if(!memcmp(tag, "wtpt", 4)) _profile_read_xyz(wtpt, d+off, len);
+    for(int k=0;k<3;k++)
+    {
+      if(!memcmp(tag, prims[k], 4) && !_profile_read_xyz(prim[k], d+off, len)) found |= 1<<k;
+      if(!memcmp(tag, trcs[k], 4)  && !_profile_read_trc(p->trc+k, d+off, len)) found |= 8<<k;
+    }
+  }
+  if(found != 0x3f) return 1; // not a matrix/trc profile
+
+  // the primaries are the columns of the d50 adapted rgb to xyz matrix.
+  // adapt from d50 to the display white with bradford: m = mai s ma a, see tools/create_colorout.sh
+  const float Ma[] = {
+     0.8951000,  0.2664000, -0.1614000,
+    -0.7502000,  1.7135000,  0.0367000,
+     0.0389000, -0.0685000,  1.0296000};
+  const float Mai[] = {
+     0.9869929, -0.1470543,  0.1599627,
+     0.4323053,  0.5183603,  0.0492912,
+    -0.0085287,  0.0400428,  0.9684867};
+  const float d50[3] = {0.96422f, 1.0f, 0.82521f};
+  float A[9], S[9] = {0}, B[9], C[9], M[9];
+  for(int i=0;i<3;i++) for(int k=0;k<3;k++) A[3*i+k] = prim[k][i];
+  for(int i=0;i<3;i++)
+  {
+    float w = 0.0f, ref = 0.0f;
+    for(int k=0;k<3;k++) { w += Ma[3*i+k]*wtpt[k]; ref += Ma[3*i+k]*d50[k]; }
+    S[4*i] = w/ref;
+  }
+  _profile_mul(Ma, A, B);
+  _profile_mul(S, B, C);
+  _profile_mul(Mai, C, M);
+  p->function = 0;
+  return _profile_invert(M, p->xyz_to_rgb);
+}
+
+static inline int _profile_load_text(profile_t *p, char *text)
+{
+  float v[12];
+  char *c = text;
+  for(int k=0;k<12;k++)
+  {
+    while(*c && !(*c == '-' || *c == '.' || (*c >= '0' && *c <= '9')))
+    { // skip everything else, including comments to the end of the line
+      if(*c == '#') while(*c && *c != '\n') c++;
+      else c++;
+    }
+    char *end;
+    v[k] = strtof(c, &end);
+    if(end == c) return 1;
+    c = end;
+  }
+  for(int k=9;k<12;k++) if(!(v[k] > 0.0f)) return 1; // encoding raises to 1/gamma
+  memcpy(p->xyz_to_rgb, v, sizeof(float)*9);
+  p->function = 0;
+  for(int k=0;k<3;k++)
+  {
+    p->trc[k].type = s_trc_gamma;
+    p->trc[k].param[0] = v[9+k];
+  }
+  return 0;
+}
+
+/* load icc or text profile, falls back to the compiled in profile on failure. */
+static inline int profile_load(profile_t *p, const char *filename)
+{
+  profile_init_custom(p);
+  FILE *f = fopen(filename, "rb");
+  if(!f) return 1;
+  fseek(f, 0, SEEK_END);
+  const size_t size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  uint8_t *d = (uint8_t *)malloc(size + 1);
+  int err = fread(d, 1, size, f) != size;
+  fclose(f);
+  if(!err)
+  {
+    d[size] = 0;
+    if(size >= 40 && !memcmp(d + 36, "acsp", 4)) err = _profile_load_icc(p, d, size);
+    else err = _profile_load_text(p, (char *)d);
+  }
+  free(d);
+  if(err)
+  {
+    fprintf(stderr, "[profile] could not read display profile `%s', using built-in\n", filename);
+    profile_init_custom(p);
+    return 1;
+  }
+  (void)strncpy(p->filename, filename, sizeof(p->filename)-1);
+  return 0;
+}
@@ -0,0 +1,500 @@
+#pragma once
+#include "fileinput.h"
+#include "cache.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* rendering on a thread of its own, so slow frames don't hold up the event loop.
+ * the gui posts immutable snapshots of what it wants to see into a single slot
+ * mailbox. a newer snapshot replaces one that was not picked up yet, and abandons
+ * the frame being rendered for an older one unless nothing was shown for a while,
+ * so the screen converges on the newest state with bounded latency. finished
+ * frames go back through a triple buffer, and a byte on a pipe wakes the gui up.
+ * frames are rendered straight into the back buffer. buffers come back from the gui
+ * with its text overlay on them, so of the views only the linear input is reused.
+ * everything below the mailbox (views, ram cache, mip pyramids, luts and the
+ * worker pool) is only touched by the render thread. */
+
+// while the user interacts, frames slower than this are shown as coarse previews first
+#define RENDER_PREVIEW_TIME 0.04
+// and refined once there was no new request for this long
+#define RENDER_REFINE_IDLE 0.06
+// frames are not abandoned for newer requests if nothing was shown for this long
+#define RENDER_MAX_STALE 0.1
+// frames rendered ahead of the one on screen, in the direction the user moves
+#define RENDER_AHEAD 4
+// frames whose pages are kept in memory ahead of the one on screen, by default and at most
+#define RENDER_WINDOW 16
+#define RENDER_WINDOW_MAX 256
+// a looping play range keeps all its pages in memory if they take at most this share of it
+#define RENDER_PIN_SHARE 4
+// while the ram cache fills, its state is shown at most this often
+#define RENDER_BAR_TIME 0.25
+
+typedef struct render_request_t
+{
+  fileinput_conversion_t conv; // conversion and view
+  int file;                    // frame to show
+  int play;                    // playing, no previews
+  int begin, end;              // play range, kept in the ram cache
+  int fill;                    // render the play range ahead into the ram cache
+  int ahead[RENDER_WINDOW_MAX];// frames likely to be wanted next, in order
+  int num_ahead;               // the window of pages kept in memory, the first RENDER_AHEAD are rendered
+}
+render_request_t;
+
+// cells of the play range bar
+#define RENDER_BAR 64
+
+typedef struct render_frame_t
+{
+  uint32_t *pixels;            // display pixels, the buffer the gui uploads
+  int file;                    // frame shown
+  int stage;                   // resolution is 1/2^stage of the full frame
+  int cached;                  // frames of the play range in the ram cache
+  int num_cells;               // how much of the play range is cached, in up to RENDER_BAR cells
+  uint8_t cell[RENDER_BAR];    // share of the frames of a cell that are cached, 0..7
+  size_t resident;             // bytes of the files in the window that are in memory
+}
+render_frame_t;
+
+typedef struct render_t
+{
+  // owned by the render thread
+  fileinput_t *file;           // the sequence, only the flags are written by the gui
+  int num_files;
+  threads_t *threads;
+  lut_t *lut;
+  fileinput_view_t view;       // what pixels shows
+  fileinput_view_t preview[2]; // previews at 1/2 and 1/4 of the resolution
+  cache_t cache;               // ram preview for playback
+  double render_time;          // of the last full frame, in seconds
+  double shown;                // when the last frame was handed to the gui
+  render_request_t req;        // the request the back buffer is rendered for
+  int stage;                   // resolution of the frame shown last
+  int back;                    // frame buffer to fill next
+  uint8_t *window;             // per file: its pages are to be kept in memory
+  size_t resident;             // bytes of the files in the window that are in memory
+  double resident_time;        // when that was counted
+  int stale;                   // the ram cache changed since the last frame was handed over
+  fileinput_conversion_t hint; // view the file on screen was last prefetched for
+
+  // shared with the gui
+  _Atomic(render_request_t *) mailbox; // newest request not picked up yet
+  render_frame_t frame[3];     // triple buffer
+  atomic_int ready;            // index of the frame in between, ored with 4 if it is new
+  int front;                   // frame the gui shows, owned by the gui
+  atomic_int quit;
+  pthread_mutex_t mutex;       // only to sleep while there is nothing to do
+  pthread_cond_t cond;
+  int pipe[2];                 // a byte per finished frame
+  pthread_t thread;
+  int running;                 // the thread was started and not joined yet, owned by the gui
+  size_t frame_size;           // bytes per display buffer
+  int width, height;           // of the frames
+  size_t capacity;             // bytes allocated for our own frame buffers, they only grow
+  int own_frames;              // the frame buffers were allocated by us
+}
+render_t;
+
+static inline int _render_cancel(void *data)
+{
+  render_t *r = (render_t *)data;
+  if(atomic_load(&r->quit)) return 1;
+  return atomic_load(&r->mailbox) && _time_wallclock() - r->shown < RENDER_MAX_STALE;
+}
+
+// for frames nobody waits for
+static inline int _render_pending(void *data)
+{
+  render_t *r = (render_t *)data;
+  return atomic_load(&r->quit) || atomic_load(&r->mailbox);
+}
+
+static inline int _render_wanted(const render_t *r, const int k)
+{
+  // a stale flag only means the frame is cached a bit later or longer
+  return cache_in_range(&r->cache, k) || r->file[k].flag;
+}
+
+/* sliding window over the page cache: the pages of the frame on screen and of the
+ * window ahead of it are read in the background, the pages of all other frames we
+ * read are dropped, so sequences larger than the memory don't thrash. a looping
+ * play range keeps all its pages if they fit in a RENDER_PIN_SHARE of the memory. */
+static inline void _render_window(render_t *r)
+{
+  const render_request_t *q = &r->req;
+  memset(r->window, 0, r->num_files);
+  r->window[q->file] = 1;
+  for(int i=0;i<q->num_ahead;i++) r->window[q->ahead[i]] = 1;
+  if(q->play)
+  {
+    size_t size = 0;
+    // headers not read yet are guessed to be like the frame on screen
+    for(int k=q->begin;k<=q->end;k++)
+      size += atomic_load(&r->file[k].state) == s_file_ready ? r->file[k].data_size : r->file[q->file].data_size;
+    if(size <= (size_t)sysconf(_SC_PHYS_PAGES)*sysconf(_SC_PAGESIZE)/RENDER_PIN_SHARE)
+      memset(r->window + q->begin, 1, q->end - q->begin + 1);
+  }
+  for(int k=0;k<r->num_files;k++)
+  {
+    fileinput_t *in = r->file + k;
+    if(in->resident && !r->window[k]) fileinput_dontneed(in);
+    else if(!in->resident && r->window[k]) fileinput_prefetch_roi(in, &q->conv);
+    in->resident = r->window[k];
+  }
+  r->resident_time = 0.0; // count again
+}
+
+/* give the file on screen the access pattern and prefetch for the view before
+ * grabbing it, unless the window did so already for this view. */
+static inline void _render_hint(render_t *r)
+{
+  fileinput_t *in = r->file + r->req.file;
+  const fileinput_conversion_t *c = &r->req.conv, *o = &r->hint;
+  if(in->resident && o->filter == c->filter &&
+     o->roi.scale == c->roi.scale && o->roi.x == c->roi.x && o->roi.y == c->roi.y &&
+     o->roi_out.w == c->roi_out.w && o->roi_out.h == c->roi_out.h)
+    return;
+  fileinput_prefetch_roi(in, c);
+  in->resident = 1;
+  r->hint = *c;
+}
+
+// bytes of the window in memory, counted at most twice a second
+static inline size_t _render_resident(render_t *r)
+{
+  const double now = _time_wallclock();
+  if(now - r->resident_time < 0.5) return r->resident;
+  r->resident = 0;
+  for(int k=0;k<r->num_files;k++)
+    if(r->file[k].resident) r->resident += fileinput_resident(r->file + k);
+  r->resident_time = now;
+  return r->resident;
+}
+
+// hand the finished back buffer to the gui
+static inline void _render_publish(render_t *r)
+{
+  render_frame_t *f = r->frame + r->back;
+  f->file = r->req.file;
+  f->stage = r->stage;
+  f->cached = cache_count(&r->cache);
+  const int n = r->cache.end - r->cache.begin + 1;
+  f->num_cells = MIN(n, RENDER_BAR);
+  for(int i=0;i<f->num_cells;i++)
+  {
+    const int b = r->cache.begin + i*n/f->num_cells, e = r->cache.begin + (i+1)*n/f->num_cells;
+    int cnt = 0;
+    for(int k=b;k<e;k++) cnt += r->cache.frame[k] != 0;
+    f->cell[i] = (7*cnt + (e-b)/2)/(e-b);
+  }
+  f->resident = _render_resident(r);
+  r->stale = 0;
+  r->back = atomic_exchange(&r->ready, r->back | 4) & 3;
+  r->shown = _time_wallclock();
+  const char c = 0;
+  if(write(r->pipe[1], &c, 1) < 0) {} // the pipe is full, the gui will come anyway
+}
+
+/* render the requested frame into the back buffer at 1/2^stage of the resolution, or
+ * in full from the ram cache if it's there. with cancel set, newer requests abandon the
+ * frame and leave the back buffer half done. returns the stage rendered, or -1 if cancelled. */
+static inline int _render_frame(render_t *r, int stage, const int cancel)
+{
+  const fileinput_cancel_t poll = { .poll = _render_cancel, .data = r };
+  const fileinput_conversion_t *c = &r->req.conv;
+  fileinput_t *in = r->file + r->req.file;
+  uint32_t *pixels = r->frame[r->back].pixels;
+  r->view.dirty = 1; // the back buffer holds an older frame
+  for(int k=0;k<2;k++) r->preview[k].dirty = 1;
+  cache_validate(&r->cache, c, r->lut->serial);
+  const uint32_t *cached = cache_get(&r->cache, r->req.file);
+  if(cached)
+  {
+    memcpy(pixels, cached, r->cache.frame_size);
+    return 0;
+  }
+  if(stage)
+  {
+    if(fileinput_grab_preview(in, c, r->threads, r->lut, cancel ? &poll : 0,
+          r->preview + stage-1, 1<<stage, pixels) == 2)
+      return -1;
+    return stage;
+  }
+  const double start = _time_wallclock();
+  const int err = fileinput_grab(in, c, r->threads, r->lut, cancel ? &poll : 0, &r->view, pixels);
+  if(err == 2) return -1;
+  if(err) memset(pixels, 0, r->frame_size); // dead frame
+  else
+  {
+    r->render_time = _time_wallclock() - start;
+    fileinput_mip_evict(r->file, r->num_files, FILEINPUT_MIP_BUDGET);
+    cache_validate(&r->cache, c, r->lut->serial); // the display lut may have been reloaded
+    if(_render_wanted(r, r->req.file)) cache_put(&r->cache, r->req.file, pixels);
+  }
+  return 0;
+}
+
+// the frame on screen again, with the current state of the ram cache
+static inline void _render_republish(render_t *r)
+{
+  if(_render_frame(r, 0, 1) < 0) return; // a new request shows it soon
+  r->stage = 0;
+  _render_publish(r);
+}
+
+/* render the next wanted frame into the ram cache: the play range starting at
+ * the current frame, then the flagged frames. returns zero if there is nothing to do. */
+static inline int _render_fill(render_t *r)
+{
+  if(!r->cache.fill) return 0;
+  const fileinput_conversion_t *c = &r->req.conv;
+  cache_validate(&r->cache, c, r->lut->serial);
+  const int n = r->cache.end - r->cache.begin + 1;
+  const int off = cache_in_range(&r->cache, r->req.file) ? r->req.file - r->cache.begin : 0;
+  int k = -1;
+  for(int i=0;i<n && k<0;i++)
+  {
+    const int j = r->cache.begin + (off + i) % n;
+    if(!r->cache.frame[j]) k = j;
+  }
+  for(int j=0;j<r->num_files && k<0;j++)
+    if(r->file[j].flag && !r->cache.frame[j]) k = j;
+  if(k < 0) return 0;
+  uint32_t *f = cache_alloc(&r->cache, k);
+  if(!f) return 0; // out of budget
+  const fileinput_cancel_t poll = { .poll = _render_pending, .data = r };
+  const int err = fileinput_grab(r->file+k, c, r->threads, r->lut, &poll, 0, f);
+  r->file[k].resident = 1; // dropped with the next window unless it is in there
+  if(err == 2)
+  { // new request, try again later
+    cache_drop(&r->cache, k);
+    return 0;
+  }
+  if(err) memset(f, 0, r->cache.frame_size); // dead frame, don't try again
+  fileinput_mip_evict(r->file, r->num_files, FILEINPUT_MIP_BUDGET);
+  cache_validate(&r->cache, c, r->lut->serial);
+  return 1;
+}
+
+/* render the first of the frames likely to come next that is not in the ram cache
+ * yet, so stepping through the sequence on a cold disk finds them ready. their
+ * pages are read in the background already, see _render_window.
+ * returns zero if there is nothing to do. */
+static inline int _render_ahead(render_t *r)
+{
+  const fileinput_conversion_t *c = &r->req.conv;
+  cache_validate(&r->cache, c, r->lut->serial);
+  int k = -1;
+  for(int i=0;i<MIN(r->req.num_ahead, RENDER_AHEAD) && k<0;i++)
+    if(!r->cache.frame[r->req.ahead[i]]) k = r->req.ahead[i];
+  if(k < 0) return 0;
+  uint32_t *f = cache_alloc(&r->cache, k);
+  if(!f) return 0; // out of budget
+  const fileinput_cancel_t poll = { .poll = _render_pending, .data = r };
+  const int err = fileinput_grab(r->file+k, c, r->threads, r->lut, &poll, 0, f);
+  if(err == 2)
+  { // new request, try again later
+    cache_drop(&r->cache, k);
+    return 0;
+  }
+  if(err) memset(f, 0, r->cache.frame_size); // dead frame, don't try again
+  fileinput_mip_evict(r->file, r->num_files, FILEINPUT_MIP_BUDGET);
+  cache_validate(&r->cache, c, r->lut->serial);
+  return 1;
+}
+
+/* wait for a request, at most timeout seconds unless negative. non-zero if there is one. */
+static inline int _render_wait(render_t *r, const double timeout)
+{
+  struct timespec until;
+  clock_gettime(CLOCK_REALTIME, &until);
+  const double t = until.tv_sec + until.tv_nsec*1e-9 + MAX(0.0, timeout);
+  until.tv_sec = (time_t)t;
+  until.tv_nsec = (long)((t - until.tv_sec)*1e9);
+  pthread_mutex_lock(&r->mutex);
+  while(!atomic_load(&r->mailbox) && !atomic_load(&r->quit))
+    if(timeout < 0.0) pthread_cond_wait(&r->cond, &r->mutex);
+    else if(pthread_cond_timedwait(&r->cond, &r->mutex, &until)) break;
+  pthread_mutex_unlock(&r->mutex);
+  return atomic_load(&r->mailbox) != 0;
+}
+
+static inline void *_render_thread(void *arg)
+{
+  render_t *r = (render_t *)arg;
+  int have = 0; // got a request yet
+  while(!atomic_load(&r->quit))
+  {
+    render_request_t *req = atomic_exchange(&r->mailbox, 0);
+    if(req && (req->conv.roi_out.w != r->width || req->conv.roi_out.h != r->height))
+    { // posted before a resize
+      free(req);
+      continue;
+    }
+    if(req)
+    {
+      r->req = *req;
+      free(req);
+      have = 1;
+      r->cache.begin = r->req.begin;
+      r->cache.end = r->req.end;
+      r->cache.fill = r->req.fill;
+      // slow frames are previewed coarsely while the user interacts, but not while playing
+      const int stage = !r->req.play && r->render_time > RENDER_PREVIEW_TIME ? 2 : 0;
+      _render_hint(r);
+      // frames of play mode are shown even if late, or fast playback would show nothing
+      const int s = _render_frame(r, stage, !r->req.play);
+      if(s >= 0)
+      {
+        r->stage = s;
+        _render_publish(r);
+      }
+      _render_window(r); // now that the frame on screen is done
+    }
+    else if(have && r->stage > 0)
+    { // refine the preview once the requests pause
+      if(!_render_wait(r, RENDER_REFINE_IDLE))
+      {
+        const int s = _render_frame(r, r->stage - 1, 1);
+        if(s >= 0)
+        {
+          r->stage = s;
+          _render_publish(r);
+        }
+      }
+    }
+    else if(have && _render_ahead(r)) continue; // the frames likely to come next
+    else if(have && _render_fill(r))
+    { // show the cache filling up now and then, the frame has to be rendered again for it
+      r->stale = 1;
+      if(_time_wallclock() - r->shown > RENDER_BAR_TIME) _render_republish(r);
+    }
+    else if(have && r->stale) _render_republish(r); // and once it is full
+    else _render_wait(r, -1.0);
+  }
+  return 0;
+}
+
+static inline int _render_start(render_t *r)
+{
+  atomic_store(&r->quit, 0);
+  if(pthread_create(&r->thread, 0, _render_thread, r)) return 1;
+  r->running = 1;
+  return 0;
+}
+
+/* stop the render thread, until render_resize starts it again. does nothing if it
+ * is not running, for instance because a resize failed. */
+static inline void render_stop(render_t *r)
+{
+  if(!r->running) return;
+  r->running = 0;
+  pthread_mutex_lock(&r->mutex);
+  atomic_store(&r->quit, 1);
+  pthread_cond_signal(&r->cond);
+  pthread_mutex_unlock(&r->mutex);
+  pthread_join(r->thread, 0);
+}
+
+/* render frames of w x h pixels from now on, into the buffers in frame or our own
+ * if it is null. memory is only reallocated if it grows. the thread has to be
+ * stopped, so the frame buffers can be reallocated before, and is started again. */
+static inline int render_resize(render_t *r, const int w, const int h, uint32_t *const frame[3])
+{
+  free(atomic_exchange(&r->mailbox, 0)); // for the old size
+  r->width = w;
+  r->height = h;
+  r->frame_size = sizeof(uint32_t)*w*h;
+  if(r->frame_size > r->capacity)
+  {
+    if(r->own_frames) for(int k=0;k<3;k++)
+    {
+      free(r->frame[k].pixels);
+      r->frame[k].pixels = (uint32_t *)calloc(1, r->frame_size);
+    }
+    r->capacity = r->frame_size;
+  }
+  if(!r->own_frames) for(int k=0;k<3;k++) r->frame[k].pixels = frame[k];
+  // nothing of the old size is shown any more
+  r->view.dirty = 1;
+  r->stage = 0;
+  r->back = 0;
+  atomic_store(&r->ready, 1);
+  r->front = 2;
+  return _render_start(r);
+}
+
+/* start rendering frames of w x h pixels for the files, straight into the three buffers
+ * in frame so they can be uploaded without another copy, or into buffers of our own if
+ * it is null. the ram cache may take cache_budget bytes, see cache_init. */
+static inline int render_init(render_t *r, fileinput_t *file, const int num_files, threads_t *threads, lut_t *lut,
+    const ssize_t cache_budget, const int w, const int h, uint32_t *const frame[3])
+{
+  memset(r, 0, sizeof(*r));
+  r->file = file;
+  r->num_files = num_files;
+  r->threads = threads;
+  r->lut = lut;
+  cache_init(&r->cache, num_files, cache_budget);
+  r->window = (uint8_t *)calloc(num_files, 1);
+  r->own_frames = !frame;
+  atomic_init(&r->ready, 1);
+  atomic_init(&r->mailbox, 0);
+  atomic_init(&r->quit, 0);
+  pthread_mutex_init(&r->mutex, 0);
+  pthread_cond_init(&r->cond, 0);
+  if(pipe(r->pipe)) return 1;
+  for(int k=0;k<2;k++) fcntl(r->pipe[k], F_SETFL, O_NONBLOCK);
+  return render_resize(r, w, h, frame);
+}
+
+static inline void render_cleanup(render_t *r)
+{
+  render_stop(r);
+  free(atomic_exchange(&r->mailbox, 0));
+  pthread_cond_destroy(&r->cond);
+  pthread_mutex_destroy(&r->mutex);
+  close(r->pipe[0]);
+  close(r->pipe[1]);
+  fileinput_view_cleanup(&r->view);
+  for(int k=0;k<2;k++) fileinput_view_cleanup(r->preview + k);
+  cache_cleanup(&r->cache);
+  free(r->window);
+  if(r->own_frames) for(int k=0;k<3;k++) free(r->frame[k].pixels);
+}
+
+/* ask for a frame, replacing any request that was not picked up yet. */
+static inline void render_post(render_t *r, const render_request_t *req)
+{
+  render_request_t *copy = (render_request_t *)malloc(sizeof(*copy));
+  *copy = *req;
+  free(atomic_exchange(&r->mailbox, copy));
+  pthread_mutex_lock(&r->mutex);
+  pthread_cond_signal(&r->cond);
+  pthread_mutex_unlock(&r->mutex);
+}
+
+/* file descriptor that becomes readable when a frame is ready. */
+static inline int render_fd(const render_t *r)
+{
+  return r->pipe[0];
+}
+
+/* the newest finished frame, or null if there is none since the last call. */
+static inline const render_frame_t *render_take(render_t *r)
+{
+  char buf[64];
+  while(read(r->pipe[0], buf, sizeof(buf)) > 0);
+  if(!(atomic_load(&r->ready) & 4)) return 0;
+  r->front = atomic_exchange(&r->ready, r->front) & 3;
+  return r->frame + r->front;
+}
@@ -0,0 +1,229 @@
+#pragma once
+#include "transform.h"
+#include "cpu.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+/* separable resampling of rows of the input image. the weights of every output
+ * column and row are tabulated once per frame, then rows are filtered
+ * horizontally into a scratch buffer and the output rows are blended from those
+ * vertically. the filters widen when minifying, so they average the whole
+ * footprint of an output pixel. the output comes in the structure-of-arrays
+ * layout the conversion kernels expect. */
+
+typedef enum resample_filter_t
+{
+  s_filter_box = 0,    // nearest neighbour up, area average down
+  s_filter_bilinear,   // tent
+  s_filter_mitchell,   // mitchell-netravali cubic, b = c = 1/3
+  s_filter_lanczos3,   // windowed sinc, three lobes
+  s_filter_cnt,
+}
+resample_filter_t;
+
+static const char *resample_filter_name[] = {"box", "bilinear", "mitchell", "lanczos3"};
+
+// support radius of the filters at unit scale
+static const float resample_filter_radius[] = {0.5f, 1.0f, 2.0f, 3.0f};
+
+static inline float resample_filter_eval(const resample_filter_t f, float x)
+{
+  x = fabsf(x);
+  switch(f)
+  {
+    case s_filter_box: return x < 0.5f ? 1.0f : 0.0f;
+    case s_filter_bilinear: return MAX(0.0f, 1.0f - x);
+    case s_filter_mitchell:
+    {
+      const float B = 1.0f/3.0f, C = 1.0f/3.0f;
+      if(x < 1.0f) return ((12-9*B-6*C)*x*x*x + (-18+12*B+6*C)*x*x + (6-2*B))/6.0f;
+      if(x < 2.0f) return ((-B-6*C)*x*x*x + (6*B+30*C)*x*x + (-12*B-48*C)*x + (8*B+24*C))/6.0f;
+      return 0.0f;
+    }
+    default:
+    {
+      if(x < 1e-5f) return 1.0f;
+      if(x >= 3.0f) return 0.0f;
+      const float px = M_PI*x;
+      return 3.0f*sinf(px)*sinf(px/3.0f)/(px*px);
+    }
+  }
+}
+
+/* normalised weights of n output pixels along one axis. */
+typedef struct resample_weights_t
+{
+  int n;               // number of output pixels
+  int taps;            // input pixels per output pixel, zero weights pad the rest
+  int n_in;            // number of input pixels, indices beyond are clamped
+  int *first;          // first input pixel per output pixel, not clamped
+  float *w;            // taps*n weights, tap major: w[n*k + t] for tap k of output pixel t
+}
+resample_weights_t;
+
+/* tabulate filter f for n output pixels. output pixel t covers the input interval
+ * origin + [t, t+1)*scale, the input has n_in pixels. returns non-zero if out of memory. */
+static inline int resample_weights_init(
+    resample_weights_t *r,
+    const resample_filter_t f,
+    const int n,
+    const float origin,
+    const float scale,
+    const int n_in)
+{
+  const float fs = MAX(1.0f, scale); // widen the filter when minifying
+  const float radius = resample_filter_radius[f] * fs;
+  r->n = n;
+  r->n_in = n_in;
+  r->taps = (int)ceilf(2.0f*radius) + 1;
+  r->first = (int *)malloc(sizeof(int)*MAX(1, n));
+  r->w = (float *)malloc(sizeof(float)*MAX(1, n)*r->taps);
+  if(!r->first || !r->w) return 1;
+  for(int t=0;t<n;t++)
+  {
+    const float c = origin + (t + .5f)*scale - .5f; // output pixel centre in input pixel indices
+    r->first[t] = (int)floorf(c - radius) + 1;
+    float sum = 0.0f;
+    for(int k=0;k<r->taps;k++)
+      sum += (r->w[n*k + t] = resample_filter_eval(f, (r->first[t] + k - c)/fs));
+    if(sum == 0.0f)
+    { // box filter centred exactly between two pixels
+      r->first[t] = (int)floorf(c + .5f);
+      r->w[t] = sum = 1.0f;
+    }
+    for(int k=0;k<r->taps;k++) r->w[n*k + t] /= sum;
+  }
+  return 0;
+}
+
+// clamped index of tap k of output pixel t
+static inline int resample_weights_idx(const resample_weights_t *r, const int t, const int k)
+{
+  return CLAMP(r->first[t] + k, 0, r->n_in - 1);
+}
+
+static inline void resample_weights_cleanup(resample_weights_t *r)
+{
+  free(r->first);
+  free(r->w);
+  r->first = 0;
+  r->w = 0;
+}
+
+/* resampling of a region of the image to x.n times y.n output pixels. */
+typedef struct resample_t
+{
+  resample_weights_t x, y; // per output column and row
+  const float *in;         // input pixels
+  int nc;                  // floats per input pixel, the first three are used
+  int width;               // input width in pixels
+}
+resample_t;
+
+static inline int resample_init(
+    resample_t *r,
+    const resample_filter_t f,
+    const float *in, const int nc, const int width, const int height,
+    const float x, const float y,           // origin of the region in input pixels
+    const float scalex, const float scaley, // input pixels per output pixel
+    const int ow, const int oh)
+{
+  r->in = in;
+  r->nc = nc;
+  r->width = width;
+  const int err = resample_weights_init(&r->x, f, ow, x, scalex, width);
+  return err | resample_weights_init(&r->y, f, oh, y, scaley, height);
+}
+
+static inline void resample_cleanup(resample_t *r)
+{
+  resample_weights_cleanup(&r->x);
+  resample_weights_cleanup(&r->y);
+}
+
+// resample rows [j0, j1), compiled once per instruction set tier
+static inline __attribute__((always_inline)) void _resample_rows(
+    const resample_t *r,
+    const int j0,
+    const int j1,
+    float *out,
+    float *tmp)
+{
+  const int ow = r->x.n, tx = r->x.taps, ty = r->y.taps, nc = r->nc;
+  const int y0 = resample_weights_idx(&r->y, j0, 0), y1 = resample_weights_idx(&r->y, j1-1, ty-1);
+  const int x0 = r->x.first[0], span = r->x.first[ow-1] + tx - x0;
+  float *plane = tmp + 3*ow*(y1 - y0 + 1);
+  // horizontal pass over all input rows touched by the band
+  for(int y=y0;y<=y1;y++)
+  {
+    // de-interleave the input span with clamped borders
+    const float *row = r->in + nc*(size_t)r->width*y;
+    for(int i=0;i<span;i++)
+    {
+      const int x = CLAMP(x0 + i, 0, r->width - 1);
+      for(int c=0;c<3;c++) plane[c*span + i] = row[nc*x + c];
+    }
+    const int *restrict first = r->x.first;
+    const float *restrict p0 = plane - x0, *restrict p1 = p0 + span, *restrict p2 = p1 + span;
+    float *restrict h0 = tmp + 3*ow*(y - y0), *restrict h1 = h0 + ow, *restrict h2 = h1 + ow;
+    for(int t=0;t<3*ow;t++) h0[t] = 0.0f;
+    for(int k=0;k<tx;k++)
+    {
+      const float *restrict w = r->x.w + ow*k;
+      for(int t=0;t<ow;t++)
+      {
+        const int i = first[t] + k;
+        h0[t] += w[t]*p0[i];
+        h1[t] += w[t]*p1[i];
+        h2[t] += w[t]*p2[i];
+      }
+    }
+  }
+  // vertical pass, contiguous along the rows
+  for(int j=j0;j<j1;j++)
+  {
+    float *o = out + 3*ow*(j - j0);
+    for(int t=0;t<3*ow;t++) o[t] = 0.0f;
+    for(int k=0;k<ty;k++)
+    {
+      const float w = r->y.w[r->y.n*k + j];
+      const float *h = tmp + 3*ow*(resample_weights_idx(&r->y, j, k) - y0);
+      for(int t=0;t<3*ow;t++) o[t] += w*h[t];
+    }
+  }
+}
+
+typedef void (*resample_rows_t)(const resample_t *, const int, const int, float *, float *);
+
+static void resample_rows_sse2(const resample_t *r, const int j0, const int j1, float *out, float *tmp)
+{
+  _resample_rows(r, j0, j1, out, tmp);
+}
+#if CPU_X86
+static CPU_TARGET_AVX2 void resample_rows_avx2(const resample_t *r, const int j0, const int j1, float *out, float *tmp)
+{
+  _resample_rows(r, j0, j1, out, tmp);
+}
+static CPU_TARGET_AVX512 void resample_rows_avx512(const resample_t *r, const int j0, const int j1, float *out, float *tmp)
+{
+  _resample_rows(r, j0, j1, out, tmp);
+}
+static const resample_rows_t _resample_rows_isa[] = {resample_rows_sse2, resample_rows_avx2, resample_rows_avx512};
+#else
+static const resample_rows_t _resample_rows_isa[] = {resample_rows_sse2, resample_rows_sse2, resample_rows_sse2};
+#endif
+
+/* resample output rows [j0, j1) into out, which holds three planes of x.n floats
+ * (red, green, blue) per row. returns non-zero if out of memory. */
+static inline int resample_rows(const resample_t *r, const int j0, const int j1, float *out)
+{
+  if(j1 <= j0 || r->x.n <= 0) return 0;
+  const int rows = resample_weights_idx(&r->y, j1-1, r->y.taps-1) - resample_weights_idx(&r->y, j0, 0) + 1;
+  const int span = r->x.first[r->x.n-1] + r->x.taps - r->x.first[0];
+  float *tmp = (float *)malloc(sizeof(float)*3*(r->x.n*rows + span));
+  if(!tmp) return 1;
+  _resample_rows_isa[cpu_isa()](r, j0, j1, out, tmp);
+  free(tmp);
+  return 0;
+}
@@ -0,0 +1,157 @@
+#pragma once
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/* persistent pool of worker threads. it is created once and reused for every frame,
+ * a job is split into a number of tasks which are handed out to the workers (and
+ * the calling thread) one at a time, so uneven tasks are balanced automatically. */
+
+typedef void (*threads_job_t)(void *data, const int task);
+
+typedef struct threads_t
+{
+  int num_threads;           // number of worker threads, not counting the caller
+  pthread_t *worker;         // worker thread handles
+
+  pthread_mutex_t run;       // serialises concurrent callers of threads_run
+  pthread_mutex_t mutex;     // protects the job description below
+  pthread_cond_t cond_job;   // wakes up the workers on a new job
+  pthread_cond_t cond_done;  // wakes up the caller when the job is done
+
+  threads_job_t job;         // currently running job
+  void *data;                // its payload
+  int num_tasks;             // number of tasks in this job
+  atomic_uint_fast64_t next; // generation of the job in the upper 32 bits, next task to be grabbed in the lower
+  int done_tasks;            // number of completed tasks
+  int busy;                  // number of workers holding on to the job
+  uint64_t generation;       // incremented for every job
+  int shutdown;              // tells the workers to quit
+}
+threads_t;
+
+/* grab the next task of the job of this generation, or -1 if there is none left.
+ * a worker that picked up a job late must not take tasks of the next one. */
+static inline int _threads_claim(threads_t *t, const uint64_t generation, const int num_tasks)
+{
+  uint_fast64_t v = atomic_load(&t->next);
+  do
+  {
+    if((uint32_t)(v >> 32) != (uint32_t)generation || (int)(uint32_t)v >= num_tasks) return -1;
+  }
+  while(!atomic_compare_exchange_weak(&t->next, &v, v + 1));
+  return (int)(uint32_t)v;
+}
+
+static inline void *_threads_worker(void *arg)
+{
+  threads_t *t = (threads_t *)arg;
+  uint64_t generation = 0;
+  pthread_mutex_lock(&t->mutex);
+  while(1)
+  {
+    while(!t->shutdown && t->generation == generation)
+      pthread_cond_wait(&t->cond_job, &t->mutex);
+    if(t->shutdown) break;
+    generation = t->generation;
+    const threads_job_t job = t->job;
+    void *data = t->data;
+    const int num_tasks = t->num_tasks;
+    t->busy++; // the caller will not return before we let go of the job
+    pthread_mutex_unlock(&t->mutex);
+
+    int done = 0;
+    for(int task; (task = _threads_claim(t, generation, num_tasks)) >= 0; done++)
+      job(data, task);
+
+    pthread_mutex_lock(&t->mutex);
+    t->done_tasks += done;
+    t->busy--;
+    if(t->done_tasks == t->num_tasks && t->busy == 0)
+      pthread_cond_signal(&t->cond_done);
+  }
+  pthread_mutex_unlock(&t->mutex);
+  return 0;
+}
+
+/* spawn the workers. pass 0 to use one thread per online cpu. */
+static inline int threads_init(threads_t *t, int num_threads)
+{
+  if(num_threads <= 0) num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  num_threads = num_threads > 1 ? num_threads - 1 : 0; // the caller helps, too
+  t->num_threads = 0;
+  t->worker = (pthread_t *)malloc(sizeof(pthread_t)*(num_threads+1));
+  pthread_mutex_init(&t->run, 0);
+  pthread_mutex_init(&t->mutex, 0);
+  pthread_cond_init(&t->cond_job, 0);
+  pthread_cond_init(&t->cond_done, 0);
+  t->job = 0;
+  t->data = 0;
+  t->num_tasks = t->done_tasks = t->busy = 0;
+  atomic_init(&t->next, 0);
+  t->generation = 0;
+  t->shutdown = 0;
+  for(int k=0;k<num_threads;k++)
+  {
+    if(pthread_create(t->worker + k, 0, _threads_worker, t)) break;
+    t->num_threads++;
+  }
+  return t->num_threads != num_threads;
+}
+
+static inline void threads_cleanup(threads_t *t)
+{
+  pthread_mutex_lock(&t->mutex);
+  t->shutdown = 1;
+  pthread_cond_broadcast(&t->cond_job);
+  pthread_mutex_unlock(&t->mutex);
+  for(int k=0;k<t->num_threads;k++)
+    pthread_join(t->worker[k], 0);
+  pthread_cond_destroy(&t->cond_done);
+  pthread_cond_destroy(&t->cond_job);
+  pthread_mutex_destroy(&t->mutex);
+  pthread_mutex_destroy(&t->run);
+  free(t->worker);
+  t->worker = 0;
+  t->num_threads = 0;
+}
+
+/* total number of threads working on a job, including the caller. */
+static inline int threads_num(const threads_t *t)
+{
+  return t ? t->num_threads + 1 : 1;
+}
+
+/* run job(data, task) for all tasks in [0, num_tasks) and wait for completion.
+ * a null pool runs everything on the calling thread. */
+static inline void threads_run(threads_t *t, threads_job_t job, void *data, const int num_tasks)
+{
+  if(!t || t->num_threads == 0 || num_tasks <= 1)
+  {
+    for(int task=0;task<num_tasks;task++) job(data, task);
+    return;
+  }
+  pthread_mutex_lock(&t->run);
+  pthread_mutex_lock(&t->mutex);
+  t->job = job;
+  t->data = data;
+  t->num_tasks = num_tasks;
+  t->done_tasks = 0;
+  const uint64_t generation = ++t->generation;
+  atomic_store(&t->next, (uint_fast64_t)(uint32_t)generation << 32);
+  pthread_cond_broadcast(&t->cond_job);
+  pthread_mutex_unlock(&t->mutex);
+
+  int done = 0;
+  for(int task; (task = _threads_claim(t, generation, num_tasks)) >= 0; done++)
+    job(data, task);
+
+  pthread_mutex_lock(&t->mutex);
+  t->done_tasks += done;
+  while(t->done_tasks < t->num_tasks || t->busy > 0)
+    pthread_cond_wait(&t->cond_done, &t->mutex);
+  pthread_mutex_unlock(&t->mutex);
+  pthread_mutex_unlock(&t->run);
+}
@@ -5,6 +5,7 @@
 #include <stdio.h>
 #include <string.h>
 #include "colorout_custom.h"
+#include "curve.h"
 
 // NaN-safe clamping (NaN compares false, and will thus result in H)
 #define CLAMP(A, L, H) (((A) > (L)) ? (((A) < (H)) ? (A) : (H)) : (L))
@@ -47,6 +48,7 @@ typedef enum transform_curve_t
   s_tonemap,       // L = L/(L+1) tonemapping
   s_isolines,      // highlight a couple of isoline steps
   s_viridis,       // colour map the [0 1] range
+  s_canon,         // base curve dumped from darktable
 }
 transform_curve_t;
 
@@ -85,6 +87,60 @@ static inline float fast_powf(float a, float b)
   return fastpow2(b * fastlog2(a));
 }
 
+// xyz to linear rgb matrices of the built-in output color spaces, row major.
+// see http://www.brucelindbloom.com/index.html?Eqn_RGB_XYZ_Matrix.html
+static const float transform_xyz_to_srgb[] =
+{
+  // sRGB D65
+  3.2404542, -1.5371385, -0.4985314,
+  -0.9692660,  1.8760108,  0.0415560,
+  0.0556434, -0.2040259,  1.0572252,
+};
+
+static const float transform_xyz_to_adobergb[] =
+{
+  // adobe rgb 1998
+  2.0413690, -0.5649464, -0.3446944,
+  -0.9692660,  1.8760108,  0.0415560,
+  0.0134474, -0.1183897,  1.0154096,
+};
+
+// adobe rgb does not have a linear toe slope, but gamma of:
+#define TRANSFORM_ADOBERGB_GAMMA (1.f/2.19921875f)
+
+static inline const float *transform_color_matrix(const transform_color_t co)
+{
+  if(co == s_adobergb) return transform_xyz_to_adobergb;
+  return transform_xyz_to_srgb; // srgb and rec709 share the primaries
+}
+
+// srgb gamma with linear toe slope: f < linear ? c*f : (a*f+b)^g
+typedef struct transform_srgb_t
+{
+  float linear, a, b, c, g;
+}
+transform_srgb_t;
+
+static inline transform_srgb_t transform_srgb_params()
+{
+  transform_srgb_t p;
+  const float linear = 0.1f, gamma = 0.4f;
+  p.linear = linear;
+  if(linear<1.0)
+  {
+    p.g = gamma*(1.0-linear)/(1.0-gamma*linear);
+    p.a = 1.0/(1.0+linear*(p.g-1));
+    p.b = linear*(p.g-1)*p.a;
+    p.c = fast_powf(p.a*linear+p.b, p.g)/linear;
+  }
+  else
+  {
+    p.a = p.b = p.g = 0.0;
+    p.c = 1.0;
+  }
+  return p;
+}
+
 static inline void transform_color(float *in, const transform_color_t ci, const transform_color_t co, const int fast)
 {
   if(ci == s_passthrough) return;
@@ -93,24 +149,19 @@ static inline void transform_color(float *in, const transform_color_t ci, const
   {
     const float xyz[3] = {in[0], in[1], in[2]};
     colorout_xyz_to_rgb(xyz, in);
+    return;
   }
-  else if(co == s_adobergb)
-  {
-    const float XYZtoRGB[] =
-    {
-      // adobe rgb 1998
-      2.0413690, -0.5649464, -0.3446944,
-      -0.9692660,  1.8760108,  0.0415560,
-      0.0134474, -0.1183897,  1.0154096,
-    };
 
-    float xyz[3] = {in[0], in[1], in[2]};
-    in[0] = in[1] = in[2] = 0.0f;
-    for(int k=0;k<3;k++)
-      for(int i=0;i<3;i++) in[k] += xyz[i]*XYZtoRGB[i+3*k];
+  const float *XYZtoRGB = transform_color_matrix(co);
+  float xyz[3] = {in[0], in[1], in[2]};
+  in[0] = in[1] = in[2] = 0.0f;
+  for(int k=0;k<3;k++)
+    for(int i=0;i<3;i++) in[k] += xyz[i]*XYZtoRGB[i+3*k];
 
-    // apply tonecurve. adobe rgb does not have a linear toe slope, but gamma of:
-    const float g = 1.f/2.19921875f;
+  if(co == s_adobergb)
+  {
+    // apply tonecurve
+    const float g = TRANSFORM_ADOBERGB_GAMMA;
     if(fast)
       for(int k=0;k<3;k++) in[k] = copysignf(fast_powf(fabsf(in[k]), g), in[k]);
     else
@@ -118,64 +169,23 @@ static inline void transform_color(float *in, const transform_color_t ci, const
   }
   else if(co == s_srgb)
   {
-    // see http://www.brucelindbloom.com/index.html?Eqn_RGB_XYZ_Matrix.html
-    const float XYZtoRGB[] =
-    {
-      // sRGB D65
-      3.2404542, -1.5371385, -0.4985314,
-      -0.9692660,  1.8760108,  0.0415560,
-      0.0556434, -0.2040259,  1.0572252,
-    };
-
-    float xyz[3] = {in[0], in[1], in[2]};
-    in[0] = in[1] = in[2] = 0.0f;
-    for(int k=0;k<3;k++)
-      for(int i=0;i<3;i++) in[k] += xyz[i]*XYZtoRGB[i+3*k];
-
     // add srgb gamma with linear toe slope:
-    float a, b, c, g;
-    const float linear = 0.1f, gamma = 0.4f;
-    if(linear<1.0)
-    {
-      g = gamma*(1.0-linear)/(1.0-gamma*linear);
-      a = 1.0/(1.0+linear*(g-1));
-      b = linear*(g-1)*a;
-      c = fast_powf(a*linear+b, g)/linear;
-    }
-    else
-    {
-      a = b = g = 0.0;
-      c = 1.0;
-    }
+    const transform_srgb_t p = transform_srgb_params();
     for(int i=0;i<3;i++)
     {
       float f = in[i];
-      if(f < linear) f = c*f;
-      else f = fast_powf(a*f+b, g);
+      if(f < p.linear) f = p.c*f;
+      else if(fast) f = fast_powf(p.a*f+p.b, p.g);
+      else f = powf(p.a*f+p.b, p.g);
       in[i] = f;
     }
   }
-  else if(co == s_rec709)
-  {
-    // see http://www.brucelindbloom.com/index.html?Eqn_RGB_XYZ_Matrix.html
-    const float XYZtoRGB[] =
-    {
-      // sRGB D65
-      3.2404542, -1.5371385, -0.4985314,
-      -0.9692660,  1.8760108,  0.0415560,
-      0.0556434, -0.2040259,  1.0572252,
-    };
-
-    float xyz[3] = {in[0], in[1], in[2]};
-    in[0] = in[1] = in[2] = 0.0f;
-    for(int k=0;k<3;k++)
-      for(int i=0;i<3;i++) in[k] += xyz[i]*XYZtoRGB[i+3*k];
-  }
+  // rec709 is linear
 }
 
-static inline void transform_gamutmap(float *in, const transform_gamut_t c)
+// mark is a running pixel index to lay out the stripes of s_gamut_mark.
+static inline void transform_gamutmap(float *in, const transform_gamut_t c, const int mark)
 {
-  static int mark = 0;
   if(c == s_gamut_clamp)
   {
     for(int k=0;k<3;k++) in[k] = MAX(in[k], 0.0f);
@@ -209,51 +219,81 @@ static inline void transform_gamutmap(float *in, const transform_gamut_t c)
     {
       in[0] = (mark&4) ? 1.0f : 0.0f;
       in[1] = in[2] = (mark&4) ? 0.0f : 1.0f;
-      mark++;
     }
   }
 }
 
-static inline void transform_curve(const float *tmp, uint8_t *out, const transform_curve_t c, int cc)
+// weight of the cosine s shape in the contrast curve, the rest is identity
+#define TRANSFORM_CONTRAST 0.5f
+
+// s shaped part of the contrast curve
+static inline float transform_contrast(const float x)
 {
-  if(c == s_contrast)
+  return .5f - cosf(CLAMP(x, 0.0f, 1.0f) * M_PI) * .5f;
+}
+
+static inline void transform_rgb_to_yuv(const float *rgb, float *yuv)
+{
+  const float M[] = {
+    0.299f, 0.587f, 0.114f,
+   -0.14713f, -0.28886f, 0.436f,
+    0.615f, -0.51499f, -0.10001f};
+  for(int i=0;i<3;i++)
   {
-    // for(int k=0;k<3;k++)
-      // out[k] = CLAMP(255.0f*canon_curve(tmp[k]), 0, 255.0);
-    for(int k=0;k<3;k++)
-    {
-      const float a = 0.5f;
-      const float f = (1.0f-a)*tmp[k] + a*(.5f - cosf(CLAMP(tmp[k], 0.0f, 1.0f) * M_PI) * .5f);
-      out[k] = CLAMP(255.0f*f, 0, 255.0);
-    }
+    yuv[i] = 0.0f;
+    for(int j=0;j<3;j++)
+      yuv[i] += M[3*i+j]*rgb[j];
   }
-  else if(c == s_tonemap)
+}
+
+// compression of luma y for the tonemap curve
+static inline float transform_tonemap_luma(const float y)
+{
+  // const float new_y = 2.0/3.0*y/(y+1.0f);
+  // log leads to more natural compression of highlights (still allows some clipping)
+  return logf(y+1.0f)/logf(10.0f);
+}
+
+// tonemap in yuv: replace y by its compressed new_y and adjust uv saturation accordingly
+static inline void transform_tonemap(float *yuv, const float new_y, float *res)
+{
+  const float Mi[] = {
+    1.0f, 0.0f, 1.13983f,
+    1.0f, -0.39465f, -0.58060f,
+    1.0f, 2.03211f,  0.0f};
+  for(int k=1;k<3;k++) yuv[k] *= CLAMP(new_y/yuv[0], 1e-5, 1e5);
+  yuv[0] = new_y;
+  for(int i=0;i<3;i++)
   {
-    // tonemap in yuv: compress y and adjust uv saturation accordingly
-    const float M[] = {
-      0.299f, 0.587f, 0.114f,
-     -0.14713f, -0.28886f, 0.436f,
-      0.615f, -0.51499f, -0.10001f};
-    const float Mi[] = {
-      1.0f, 0.0f, 1.13983f,
-      1.0f, -0.39465f, -0.58060f,
-      1.0f, 2.03211f,  0.0f};
-    float yuv[3] = {0.0f};
-    for(int i=0;i<3;i++)
+    res[i] = 0.0f;
     for(int j=0;j<3;j++)
-      yuv[i] += M[3*i+j]*tmp[j];
-    // const float new_y = 2.0/3.0*yuv[0]/(yuv[0]+1.0f);
-    // log leads to more natural compression of highlights (still allows some clipping)
-    const float new_y = logf(yuv[0]+1.0f)/logf(10.0f);
-    for(int k=1;k<3;k++) yuv[k] *= CLAMP(new_y/yuv[0], 1e-5, 1e5);
-    yuv[0] = new_y;
-    float rgb[3] = {0.0f};
-    for(int i=0;i<3;i++)
-    for(int j=0;j<3;j++)
-      rgb[i] += Mi[3*i+j]*yuv[j];
+      res[i] += Mi[3*i+j]*yuv[j];
+  }
+}
 
+static inline void transform_viridis(float x, float *res)
+{
+  x = CLAMP(x, 0.0, 1.0);
+  float x2 = x*x, x3 = x2*x, x4 = x2*x2, x5 = x3*x2;
+  res[0] = +0.280268003 -0.143510503*x +2.2257938770*x2  -14.815088879*x3 + +25.212752309*x4 -11.772589584*x5;
+  res[1] = -0.002117546 +1.617109353*x -1.9093050700*x2  +2.701152864 *x3 + -1.685288385 *x4  +0.178738871*x5;
+  res[2] = +0.300805501 +2.614650302*x -12.019139090*x2 +28.933559110 *x3 + -33.491294770*x4 +13.762053843*x5;
+}
+
+// evaluate the curve on linear rgb tmp, result is in [0,1] display range (not clamped yet).
+// this is the exact reference, the display path uses the tables baked from it in lut.h.
+static inline void transform_curve_eval(const float *tmp, float *res, const transform_curve_t c, int cc)
+{
+  if(c == s_contrast)
+  {
     for(int k=0;k<3;k++)
-      out[k] = CLAMP(255.0f*rgb[k], 0, 255.0);
+      res[k] = (1.0f-TRANSFORM_CONTRAST)*tmp[k] + TRANSFORM_CONTRAST*transform_contrast(tmp[k]);
+  }
+  else if(c == s_tonemap)
+  {
+    float yuv[3];
+    transform_rgb_to_yuv(tmp, yuv);
+    transform_tonemap(yuv, transform_tonemap_luma(yuv[0]), res);
   }
   else if(c == s_isolines)
   {
@@ -264,26 +304,26 @@ static inline void transform_curve(const float *tmp, uint8_t *out, const transfo
       md = fminf(md, fabsf(f - k/(num-1.0f)));
     float wd = 0.01f;
     const float col = fmaxf(0.0f, (wd - md)/wd);
-    for(int k=0;k<3;k++)
-      out[k] = CLAMP(255.0f*col, 0, 255.0);
+    for(int k=0;k<3;k++) res[k] = col;
   }
   else if(c == s_viridis)
   {
-    float x = tmp[cc % 3];
-    x = CLAMP(x, 0.0, 1.0);
-    float x2 = x*x, x3 = x2*x, x4 = x2*x2, x5 = x3*x2;
-    const float col[] = {
-      +0.280268003 -0.143510503*x +2.2257938770*x2  -14.815088879*x3 + +25.212752309*x4 -11.772589584*x5,
-      -0.002117546 +1.617109353*x -1.9093050700*x2  +2.701152864 *x3 + -1.685288385 *x4  +0.178738871*x5,
-      +0.300805501 +2.614650302*x -12.019139090*x2 +28.933559110 *x3 + -33.491294770*x4 +13.762053843*x5,
-    };
-    for(int k=0;k<3;k++)
-      out[k] = CLAMP(255.0f*col[k], 0, 255.0);
+    transform_viridis(tmp[cc % 3], res);
+  }
+  else if(c == s_canon)
+  {
+    for(int k=0;k<3;k++) res[k] = canon_curve(tmp[k]);
   }
   else
   {
-    for(int k=0;k<3;k++)
-      out[k] = CLAMP(255.0f*tmp[k], 0, 255.0);
+    for(int k=0;k<3;k++) res[k] = tmp[k];
   }
 }
 
+static inline void transform_curve(const float *tmp, uint8_t *out, const transform_curve_t c, int cc)
+{
+  float res[3];
+  transform_curve_eval(tmp, res, c, cc);
+  for(int k=0;k<3;k++)
+    out[k] = CLAMP(255.0f*res[k], 0, 255.0);
+}
@@ -0,0 +1,190 @@
+#pragma once
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/io_uring.h>
+#endif
+
+/* just enough io_uring to read large ranges of a file with many requests in
+ * flight, driven by the raw system calls so we don't depend on liburing. the
+ * range is cut into URING_CHUNK sized reads, up to URING_DEPTH of them are
+ * queued at once and the rest of short reads is read synchronously. if the kernel
+ * has no io_uring (or it is forbidden), reads fall back to pread. */
+
+// reads in flight
+#define URING_DEPTH 32
+// bytes per read
+#define URING_CHUNK (1ul<<20)
+
+typedef struct uring_t
+{
+  int fd;                      // of the ring, -1 if we fall back to pread
+  void *sq_ring, *cq_ring;     // mapped rings
+  size_t sq_size, cq_size;
+  struct io_uring_sqe *sqe;    // submission queue entries
+  size_t sqe_size;
+  unsigned *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqe;
+}
+uring_t;
+
+static inline void uring_cleanup(uring_t *u)
+{
+  if(u->sqe) munmap(u->sqe, u->sqe_size);
+  if(u->cq_ring && u->cq_ring != u->sq_ring) munmap(u->cq_ring, u->cq_size);
+  if(u->sq_ring) munmap(u->sq_ring, u->sq_size);
+  if(u->fd >= 0) close(u->fd);
+  memset(u, 0, sizeof(*u));
+  u->fd = -1;
+}
+
+/* set up the ring. returns non-zero if there is none, reads use pread then. */
+static inline int uring_init(uring_t *u)
+{
+  memset(u, 0, sizeof(*u));
+#ifndef __linux__
+  u->fd = -1;
+  return 1;
+#else
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  u->fd = syscall(__NR_io_uring_setup, URING_DEPTH, &p);
+  if(u->fd < 0)
+  {
+    u->fd = -1;
+    return 1;
+  }
+  u->sq_size = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+  u->cq_size = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+  if(p.features & IORING_FEAT_SINGLE_MMAP)
+    u->sq_size = u->cq_size = u->sq_size > u->cq_size ? u->sq_size : u->cq_size;
+  u->sq_ring = mmap(0, u->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+  if(u->sq_ring == MAP_FAILED) goto fail;
+  u->cq_ring = u->sq_ring;
+  if(!(p.features & IORING_FEAT_SINGLE_MMAP))
+    u->cq_ring = mmap(0, u->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+  if(u->cq_ring == MAP_FAILED) goto fail;
+  u->sqe_size = p.sq_entries*sizeof(struct io_uring_sqe);
+  u->sqe = mmap(0, u->sqe_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+  if(u->sqe == MAP_FAILED) goto fail;
+  u->sq_tail  = (unsigned *)((char *)u->sq_ring + p.sq_off.tail);
+  u->sq_mask  = (unsigned *)((char *)u->sq_ring + p.sq_off.ring_mask);
+  u->sq_array = (unsigned *)((char *)u->sq_ring + p.sq_off.array);
+  u->cq_head  = (unsigned *)((char *)u->cq_ring + p.cq_off.head);
+  u->cq_tail  = (unsigned *)((char *)u->cq_ring + p.cq_off.tail);
+  u->cq_mask  = (unsigned *)((char *)u->cq_ring + p.cq_off.ring_mask);
+  u->cqe = (struct io_uring_cqe *)((char *)u->cq_ring + p.cq_off.cqes);
+  return 0;
+fail:
+  if(u->sq_ring == MAP_FAILED) u->sq_ring = 0;
+  if(u->cq_ring == MAP_FAILED) u->cq_ring = 0;
+  if(u->sqe == MAP_FAILED) u->sqe = 0;
+  uring_cleanup(u);
+  return 1;
+#endif
+}
+
+// read with pread, for kernels without io_uring
+static inline int _uring_pread(const int fd, uint8_t *buf, size_t size, off_t offset)
+{
+  while(size)
+  {
+    const ssize_t res = pread(fd, buf, size, offset);
+    if(res < 0 && errno == EINTR) continue;
+    if(res == 0) return 0; // end of file
+    if(res < 0) return 1;
+    buf += res;
+    offset += res;
+    size -= res;
+  }
+  return 0;
+}
+
+/* read size bytes at offset of the file fd into buf, or up to the end of the file.
+ * returns non-zero on errors. */
+static inline int uring_read(uring_t *u, const int fd, void *buf, const size_t size, const off_t offset)
+{
+  if(u->fd < 0) return _uring_pread(fd, (uint8_t *)buf, size, offset);
+#ifdef __linux__
+  struct { size_t pos, len; } slot[URING_DEPTH];
+  int free_slot[URING_DEPTH], num_free = URING_DEPTH, err = 0;
+  int pending = 0, inflight = 0; // in the ring but not taken by the kernel yet, and taken
+  for(int k=0;k<URING_DEPTH;k++) free_slot[k] = k;
+  size_t next = 0; // bytes queued so far
+  while(inflight || pending || (next < size && !err))
+  {
+    // queue as much as there is room for
+    unsigned tail = *u->sq_tail;
+    while(num_free && next < size && !err)
+    {
+      const int s = free_slot[--num_free];
+      slot[s].pos = next;
+      slot[s].len = size - next < URING_CHUNK ? size - next : URING_CHUNK;
+      next += slot[s].len;
+      const unsigned i = tail & *u->sq_mask;
+      struct io_uring_sqe *e = u->sqe + i;
+      memset(e, 0, sizeof(*e));
+      e->opcode = IORING_OP_READ;
+      e->fd = fd;
+      e->addr = (uint64_t)(uintptr_t)((uint8_t *)buf + slot[s].pos);
+      e->len = slot[s].len;
+      e->off = offset + slot[s].pos;
+      e->user_data = s;
+      u->sq_array[i] = i;
+      tail++;
+      pending++;
+    }
+    __atomic_store_n(u->sq_tail, tail, __ATOMIC_RELEASE);
+    // the kernel may take fewer entries than we offer, the others stay in the ring for next time
+    const int ret = syscall(__NR_io_uring_enter, u->fd, pending, 1, IORING_ENTER_GETEVENTS, 0, 0);
+    if(ret >= 0)
+    {
+      pending -= ret;
+      inflight += ret;
+    }
+    else if(errno != EINTR && pending)
+    { // take back what the kernel did not take, it must not see it later, and read the rest with pread
+      for(int k=0;k<pending;k++)
+      {
+        const int s = u->sqe[u->sq_array[(tail - pending + k) & *u->sq_mask]].user_data;
+        if(!err) err = _uring_pread(fd, (uint8_t *)buf + slot[s].pos, slot[s].len, offset + slot[s].pos);
+        free_slot[num_free++] = s;
+      }
+      __atomic_store_n(u->sq_tail, tail - pending, __ATOMIC_RELEASE);
+      pending = 0;
+      if(!err && next < size) err = _uring_pread(fd, (uint8_t *)buf + next, size - next, offset + next);
+      next = size; // we still wait for what is in flight
+    }
+    // reap what is done
+    unsigned head = *u->cq_head;
+    const unsigned end = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+    for(;head != end;head++)
+    {
+      const struct io_uring_cqe *c = u->cqe + (head & *u->cq_mask);
+      const int s = c->user_data;
+      inflight--;
+      if(c->res > 0)
+      {
+        slot[s].pos += c->res;
+        slot[s].len -= c->res;
+      }
+      else if(c->res == 0) slot[s].len = 0; // end of file
+      else if(c->res != -EINTR && c->res != -EAGAIN) err = 1;
+      // short reads are rare (signals, end of file), read the rest synchronously
+      if(!err && slot[s].len && _uring_pread(fd, (uint8_t *)buf + slot[s].pos, slot[s].len, offset + slot[s].pos))
+        err = 1;
+      free_slot[num_free++] = s;
+    }
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+  }
+  return err;
+#else
+  return 1;
+#endif
+}
@@ -97,24 +97,28 @@ cat > color/colorout_custom.h << EOF
 #ifndef CORONA_COLOROUT_H
 #define CORONA_COLOROUT_H
 
+// matrix and gammas below are read by profile.h, older headers only have the function
+#define COLOROUT_CUSTOM_PROFILE
+
+// created for $1
+static const float colorout_custom_xyz_to_rgb[] =
+{
+  $i00, $i01, $i02,
+  $i10, $i11, $i12,
+  $i20, $i21, $i22,
+};
+
+// gamma of the red, green and blue tone curves
+static const float colorout_custom_gamma[] = { $gr, $gg, $gb };
+
 static inline void colorout_xyz_to_rgb(const float *const xyz, float *rgb)
 {
-  // created for $1
-  const float XYZtoRGB[] =
-  {
-    $i00, $i01, $i02,
-    $i10, $i11, $i12,
-    $i20, $i21, $i22,
-  };
-
-  memset(rgb, 0, sizeof(float)*3);
+  rgb[0] = rgb[1] = rgb[2] = 0.0f;
   for(int k=0;k<3;k++)
-    for(int i=0;i<3;i++) rgb[k] += xyz[i]*XYZtoRGB[i+3*k];
-  
+    for(int i=0;i<3;i++) rgb[k] += xyz[i]*colorout_custom_xyz_to_rgb[i+3*k];
+
   // apply tonecurve
-  rgb[0] = powf(rgb[0], 1.f/$gr);
-  rgb[1] = powf(rgb[1], 1.f/$gg);
-  rgb[2] = powf(rgb[2], 1.f/$gb);
+  for(int k=0;k<3;k++) rgb[k] = powf(rgb[k], 1.f/colorout_custom_gamma[k]);
 }
 
 #endif